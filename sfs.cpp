@@ -2,13 +2,49 @@
 #include <string.h>
 #include <math.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <time.h>
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
 
+#ifndef SFS_BLOCK_SIZE
+#define SFS_BLOCK_SIZE 1024 // bytes in a block; a power of two from 1024 to 65536, set when compiling
+#endif
+#if SFS_BLOCK_SIZE < 1024 || SFS_BLOCK_SIZE > 65536 || (SFS_BLOCK_SIZE & (SFS_BLOCK_SIZE - 1)) != 0
+#error SFS_BLOCK_SIZE must be a power of two from 1024 to 65536
+#endif
+#define FILE_MAX (3 * SFS_BLOCK_SIZE)								// largest file, in bytes
+#define USAGE_PER_BLOCK (int)(SFS_BLOCK_SIZE / sizeof(_usage_entry)) // usage entries in one block of the usage table
 #define BLOCK_SUPER 0
 #define BLOCK_BLOCK_BITMAP 1
 #define BLOCK_INODE_BITMAP 2
 #define BLOCK_INODE_TABLE 3
 #define BLOCK_MAX 99
 #define INODE_MAX 127
+#define SNAP_MAX 32
+#define STRIPE_MAX 8 // most image files the disk can be striped over
+#define DIR_HEADER 9 // bytes before the name in a directory record
+#ifndef CACHE_BLOCKS
+#define CACHE_BLOCKS 32 // memory budget of the block cache, in blocks; can be set when compiling
+#endif
+#ifndef PUNCH_HOLES
+#define PUNCH_HOLES 1 // give freed blocks back to the host file system; can be set to 0 when compiling
+#endif
+#define READAHEAD_MAX (CACHE_BLOCKS / 4) // largest readahead window, in blocks
+#define READAHEAD_STREAMS 8				 // files and directories whose access pattern is followed
+#define LS_BATCH 64						 // directory entries ls holds in memory at a time
+#ifndef DEFRAG_PAUSE
+#define DEFRAG_PAUSE 2000 // microseconds defrag waits after moving a file or directory; can be set when compiling
+#endif
+#define FIND_PREFETCH (CACHE_BLOCKS / 2) // directory blocks find reads ahead of its walk
+#define RUN_BLOCKS 32					 // blocks a batch gathers before writing them with one write
 
 // structure of an inode entry
 typedef struct
@@ -17,7 +53,17 @@ typedef struct
 	char XX[2], YY[2], ZZ[2]; // the blocks for this entry; 00 means not used
 } _inode_entry;
 
-// structure of a directory entry
+// structure of a directory record; records are packed one after the other in a directory block,
+// and the first one with a length of 0 (or no length at all) marks the end
+typedef struct
+{
+	char MMM[3]; // inode entry index which holds more info about this entry
+	char RRR[3]; // length of the whole record
+	char NNN[3]; // length of the name, which follows right after; no null character
+} _directory_record;
+
+// structure of a directory entry in the old fixed size format; four of them filled a block
+// only used to convert old disks
 typedef struct
 {
 	char F;			 // '1' means used; '0' means unused
@@ -25,40 +71,255 @@ typedef struct
 	char MMM[3];	 // inode entry index which holds more info about this entry
 } _directory_entry;
 
+// structure of a snapshot entry
+typedef struct
+{
+	char F;			// '1' means used; '0' means unused
+	char sname[15]; // name of the snapshot; remember to include null character into it
+	char MB[8][2];	// blocks holding copies of the block bitmap, inode bitmap, inode table, file size table, usage table (two blocks), link count table and share table; 00 means not used
+} _snapshot_entry;
+
+// structure of a usage entry; a directory's entry adds up everything below it
+typedef struct
+{
+	char PPP[3];   // inode entry of the directory this entry is in
+	char BYTES[7]; // bytes of file data
+	char BLK[3];   // blocks used, directory blocks included
+	char FIL[3];   // number of files
+} _usage_entry;
+
+// structure of a directory cursor; says where a walk over a directory has got to
+typedef struct
+{
+	int inode; // inode entry of the directory
+	int slot;  // block (0, 1 or 2) holding the next record; 3 means the walk is over
+	int pos;   // byte in that block where the next record starts
+} _dir_cursor;
+
+// structure of a directory entry handed out by readDir
+typedef struct
+{
+	int inode;		 // inode entry index which holds more info about this entry
+	char type;		 // 'F' for a file and 'D' for a directory
+	char name[252];	 // name of this entry
+} _dir_item;
+
+// structure of a directory waiting in the find queue
+typedef struct
+{
+	int inode;		// inode entry of the directory
+	int parent;		// queue position of the directory it is in; -1 for where the search started
+	char name[252]; // name of the directory
+} _find_item;
+
+// structure of a trace record; the command line follows it, and then the content typed for the command
+typedef struct
+{
+	uint64_t usec;		// when the command was given, in microseconds since tracing started
+	uint32_t latency;	// how long the command took, in microseconds, not counting typing
+	uint32_t input_len; // length of the content typed for the command
+	uint16_t line_len;	// length of the command line
+} _trace_record;
+
+// structure of a trace record in traces that start with SFSTRACE, from before format 2
+typedef struct
+{
+	uint32_t usec;
+	uint32_t latency;
+	uint16_t line_len;
+	uint16_t input_len;
+} _trace_record_v1;
+
+// structure of a block cache entry
+typedef struct
+{
+	int block;			// block number held; -1 means unused
+	unsigned long used; // when it was last used; the oldest entry is reused first
+	char data[SFS_BLOCK_SIZE];	// contents of the block
+} _cache_entry;
+
+// structure of the readahead state of a file or directory
+typedef struct
+{
+	int inode;	// inode entry followed; -1 means unused
+	int next;	// block (0, 1 or 2) a sequential reader would want next
+	int window; // number of blocks read ahead; doubles while access stays sequential
+} _readahead_state;
+
 // SFS metadata; read during mounting
 int BLB;						// total number of blocks
 int INB;						// total number of entries in inode table
-char _block_bitmap[1024];		// the block bitmap array
-char _inode_bitmap[1024];		// the inode bitmap array
-_inode_entry _inode_table[128]; // the inode table containing 128 inode entries
+char _block_bitmap[SFS_BLOCK_SIZE];		// the block bitmap array
+char _inode_bitmap[SFS_BLOCK_SIZE];		// the inode bitmap array
+_inode_entry _inode_table[SFS_BLOCK_SIZE / sizeof(_inode_entry)]; // the inode table; only the first 128 inode entries are used
+int CSB;						// block holding the block checksum table; 0 means checksums are off
+char _block_checksums[SFS_BLOCK_SIZE];	// CRC32C of every block as 8 hex digits; entry i is for block i
+int SNB;						// block holding the snapshot table; 0 means no snapshot was ever taken
+_snapshot_entry _snapshot_table[SFS_BLOCK_SIZE / sizeof(_snapshot_entry)]; // the snapshot table; only the first SNAP_MAX entries are used
+int ISB;						// block holding the file size table; 0 means sizes are worked out from the data
+char _inode_sizes[SFS_BLOCK_SIZE];		// exact size in bytes of every file as 8 digits; entry i is for inode entry i
+int UTB[2];						// blocks holding the usage table; 0 means usage is not kept yet
+_usage_entry _usage_table[2 * USAGE_PER_BLOCK]; // usage of every file and of everything below every directory; entry i is for inode entry i
+int LCB;						// block holding the link count table; 0 means every file has one name
+char _link_counts[SFS_BLOCK_SIZE];		// number of directory records pointing at every inode entry as 3 digits, then another directory with such a record; entry i is for inode entry i
+int SHB;						// block holding the share table; 0 means no block was ever shared
+char _share_counts[SFS_BLOCK_SIZE];	// number of inode entries sharing every block as 3 digits, 0 if only one uses it; entry i is for block i
 
 // useful info
 int free_disk_blocks;					   // number of available disk blocks
 int free_inode_entries;					   // number of available entries in inode table
 int CD_INODE_ENTRY = 0;					   // index of inode entry of the current directory in the inode table
 char current_working_directory[252] = "/"; // name of current directory (useful in the prompt)
+int _block_refcount[1024];				   // number of snapshots still holding each block
+int _block_shares[1024];				   // number of inode entries of the live file system using each block
+int SNAP_MOUNTED = -1;					   // snapshot entry mounted read-only; -1 means the live file system
+
+FILE *df = NULL; // THE DISK FILE; holds block 0, and all others unless the disk is striped
+
+// striping; blocks go round the image files sfs.disk, sfs.disk.1, ... a stripe unit at a time
+FILE *_stripe_files[STRIPE_MAX]; // the image files; the first one is df
+int STRIPES = 1;				  // number of image files
+int STRIPE_UNIT = 1;			  // blocks in a row that go to the same image file
+int STRIPE_SET = 0;				  // names the other image files use; sfs.disk.1, ... or sfs.disk.b1, ...
 
-FILE *df = NULL; // THE DISK FILE
+// block cache; every read and write of a block goes through it
+_cache_entry _block_cache[CACHE_BLOCKS];
+_readahead_state _readahead_table[READAHEAD_STREAMS];
+unsigned long cache_clock = 0;		  // counts block cache accesses
+int cache_hits = 0, cache_misses = 0; // for stat
+int blocks_read_ahead = 0;			  // for stat
+
+// write batches; while one is open, metadata is kept in memory and blocks are written in runs
+int METADATA_BATCH = 0;			  // number of batches open; 0 means every write goes straight to the disk file
+char _batch_dirty[BLOCK_MAX + 1]; // metadata blocks changed since the batch was opened
+char _punch_pending[BLOCK_MAX + 1]; // blocks freed in the batch, given back to the host once the metadata is written
+char _run_data[RUN_BLOCKS * SFS_BLOCK_SIZE]; // blocks waiting to be written; they follow each other on disk
+int run_start = 0, run_len = 0;	   // first block of the run and number of blocks in it
+
+// tracing; commands and the content typed for them are recorded to be replayed later
+FILE *trace_file = NULL;	 // trace being recorded; NULL means not tracing
+long trace_start;			 // when tracing started, in microseconds
+int trace_ops = 0;			 // commands recorded so far
+char trace_input[FILE_MAX];		 // content typed for the command being run
+int trace_input_len = 0;
+long trace_typing = 0;		 // microseconds the command being run spent waiting for that content
+char *replay_input = NULL;	 // content read_input hands out instead of reading the keyboard; NULL means not replaying
+int replay_input_len = 0, replay_input_pos = 0;
 
 // function declarations
 // HELPERS
 int stoi(char *, int);
 void itos(char *, int, int);
 void printPrompt();
+uint32_t crc32c(const char *, int);
+long nowMicros();
 
 // DISK ACCESS
 void mountSFS();
+void unmountSFS();
+void makeSFS(int);
+void stripeName(char *, int);
+void diskIO(int, int, char *, int);
+int diskZero(int, int, int);
+void restripe(int, int);
 int readSFS(int, char *);
 int writeSFS(int, char *);
+char *batchedTable(int);
+void beginBatch();
+void flushRun();
+void endBatch();
+
+// BLOCK CACHE
+void cacheClear();
+int cacheFind(int);
+void cacheStore(int, char *);
+void prefetchBlocks(int *, int);
+void readAhead(int, int, int);
 
 // BITMAP ACCESS
 int getBlock();
+int takeBlock(int);
 void returnBlock(int);
+void punchBlock(int);
 int getInode();
 void returnInode(int);
 
+// INTEGRITY
+void stampBlock(int, char *);
+void fsck(int);
+
+// DIRECTORY RECORDS
+int nextRecord(char *, int *, int *, char *);
+int recordsEnd(char *);
+int addRecord(char *, char *, int);
+void removeRecord(char *, int);
+void convertDirectories();
+int isConverted(char *);
+void openDir(_dir_cursor *, int);
+int readDir(_dir_cursor *, _dir_item *, int);
+
+// SNAPSHOTS
+int cowBlock(int, int);
+int isReadOnly();
+void snapCreate(char *);
+void snapList();
+void snapMount(char *);
+void snapUmount();
+void snapRemove(char *);
+
+// USAGE
+void computeUsage(_usage_entry *);
+void usageWalk(_usage_entry *, char *, int, int);
+int setupUsage();
+void saveUsage(int);
+void setParent(int, int);
+void addUsage(int, int, int, int);
+void dropUsage(int);
+void moveUsage(int, int);
+
+// LINKS AND SHARING
+void computeShares();
+int recordedShares(int);
+int setShares(int, int);
+int shareOwner(int, int);
+int linkCount(int);
+int setLinkCount(int, int);
+int otherParent(int);
+void setOtherParent(int, int);
+int dirLinks(int, int);
+int findParent(int, int);
+
+// TRACING
+void traceStart(char *);
+void traceStop();
+void traceRecord(char *, long, long);
+int readTraceRecord(FILE *, int, _trace_record *);
+int compareLatency(const void *, const void *);
+void replayTrace(char *, int);
+void run_command(char *);
+
+// FILE DATA
+int read_input(char *, int);
+int find_entry(char *, char);
+int find_in(int, char *, char);
+int find_path(char *);
+int get_file_data(int, char *);
+int file_size(int);
+int set_file_size(int, int);
+void print_file_data(int, int, int);
+
 // COMMANDS
-void ls();
+int morePrompt();
+void ls(int, int);
+void du(char *);
+void find(char *, char *);
+void findPath(char *, _find_item *, int, char *);
+int fileExtents(int);
+int freeRuns(int *);
+int freeRunAt(int, int);
+int relocate(int, int);
+int relocateTables();
+void defrag(int);
 void rd();
 void cd(char *);
 void md(char *);
@@ -105,7 +366,71 @@ void itos(char *s, int num, int n)
 
 void printPrompt()
 {
-	printf("SFS::%s# ", current_working_directory);
+	if (SNAP_MOUNTED != -1)
+		printf("SFS@%s::%s# ", _snapshot_table[SNAP_MOUNTED].sname, current_working_directory);
+	else
+		printf("SFS::%s# ", current_working_directory);
+}
+
+/****************************************************************************/
+/* returns the CRC32C (Castagnoli) checksum of the n bytes at s
+/* uses the SSE4.2 crc32 instruction when compiled with it (-msse4.2),
+/* otherwise a table driven version
+/*
+/****************************************************************************/
+
+uint32_t crc32c(const char *s, int n)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	int i = 0;
+
+#ifdef __SSE4_2__
+#ifdef __x86_64__
+	uint64_t crc64 = crc;
+	for (; i + 8 <= n; i += 8)
+	{
+		uint64_t word;
+		memcpy(&word, s + i, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	crc = (uint32_t)crc64;
+#endif
+	for (; i < n; i++)
+		crc = _mm_crc32_u8(crc, s[i]);
+#else
+	static uint32_t table[256];
+	static int table_ready = 0;
+	int j;
+
+	if (!table_ready)
+	{ // build the lookup table once; 0x82F63B78 is the reflected Castagnoli polynomial
+		for (j = 0; j < 256; j++)
+		{
+			uint32_t c = j;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : (c >> 1);
+			table[j] = c;
+		}
+		table_ready = 1;
+	}
+	for (; i < n; i++)
+		crc = table[(crc ^ (unsigned char)s[i]) & 0xFF] ^ (crc >> 8);
+#endif
+
+	return crc ^ 0xFFFFFFFF;
+}
+
+/****************************************************************************/
+/* returns the time in microseconds from some fixed point
+/*
+/****************************************************************************/
+
+long nowMicros()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
 }
 
 /*############################################################################*/
@@ -117,7 +442,8 @@ void printPrompt()
 void mountSFS()
 {
 	int i;
-	char buffer[1024];
+	char buffer[SFS_BLOCK_SIZE];
+	char snap_bitmap[SFS_BLOCK_SIZE]; // buffer keeps the superblock until mounting is done
 
 	df = fopen("sfs.disk", "r+b");
 	if (df == NULL)
@@ -125,542 +451,3466 @@ void mountSFS()
 		printf("Disk file sfs.disk not found.\n");
 		exit(1);
 	}
+	cacheClear();
+
+	// read superblock; block 0 always is at the start of sfs.disk
+	fread(buffer, 1, SFS_BLOCK_SIZE, df);
+
+	// the block size is fixed when the program is compiled; disks made before it was kept have 1 KB blocks
+	i = (stoi(buffer + 22, 2) > 0 ? stoi(buffer + 22, 2) * 1024 : 1024);
+	if (i != SFS_BLOCK_SIZE)
+	{
+		printf("sfs.disk has %d byte blocks, but this program was compiled for %d byte blocks.\n", i, SFS_BLOCK_SIZE);
+		printf("Compile it with -DSFS_BLOCK_SIZE=%d, or start it as \"sfs mkfs\" to make a new disk.\n", i);
+		exit(1);
+	}
+
+	// then open the other image files if the disk is striped
+	STRIPES = stoi(buffer + 13, 1);
+	STRIPE_UNIT = stoi(buffer + 14, 2);
+	STRIPE_SET = (buffer[24] == '1');
+	if (STRIPES < 1 || STRIPES > STRIPE_MAX || STRIPE_UNIT < 1)
+		STRIPES = STRIPE_UNIT = 1; // written before striping existed
+	_stripe_files[0] = df;
+	for (i = 1; i < STRIPES; i++)
+	{
+		char name[32];
+		stripeName(name, i);
+		if ((_stripe_files[i] = fopen(name, "r+b")) == NULL)
+		{
+			printf("Disk file %s not found.\n", name);
+			exit(1);
+		}
+	}
 
-	// read superblock
-	fread(buffer, 1, 1024, df);
 	BLB = stoi(buffer, 3);
 	INB = stoi(buffer + 3, 3);
 	printf("BLB: %d INB:%d\n",BLB,INB);
+	if (BLB > BLOCK_MAX + 1)
+		BLB = BLOCK_MAX + 1; // inode entries can only point at two digit block numbers
+	if (INB > INODE_MAX + 1)
+		INB = INODE_MAX + 1; // the inode table has room for no more
 	// read block bitmap
-	fread(_block_bitmap, 1, 1024, df);
+	diskIO(BLOCK_BLOCK_BITMAP, 1, _block_bitmap, 0);
 	// initialize number of free disk blocks
 	free_disk_blocks = BLB;
 	for (i = 0; i < BLB; i++)
 		free_disk_blocks -= (_block_bitmap[i] - 48);
 
 	// read inode bitmap
-	fread(_inode_bitmap, 1, 1024, df);
+	diskIO(BLOCK_INODE_BITMAP, 1, _inode_bitmap, 0);
 	// initialize number of unused inode entries
 	free_inode_entries = INB;
 	for (i = 0; i < INB; i++)
 		free_inode_entries -= (_inode_bitmap[i] - 48);
 
 	// read the inode table
-	fread(_inode_table, 1, 1024, df);
-}
+	diskIO(BLOCK_INODE_TABLE, 1, (char *)_inode_table, 0);
 
-/****************************************************************************/
-/* reads a block of data from disk file into buffer
-/* returns 0 if invalid block number
-/*
-/****************************************************************************/
+	// checksums are only on if fsck has set up a valid checksum table
+	CSB = stoi(buffer + 6, 2);
+	if (CSB <= BLOCK_INODE_TABLE || CSB > BLOCK_MAX || _block_bitmap[CSB] != '1')
+		CSB = 0;
+	else
+	{
+		diskIO(CSB, 1, _block_checksums, 0);
+	}
 
-int readSFS(int block_number, char buffer[1024])
-{
+	// exact file sizes are kept once a file has been written with this version
+	ISB = stoi(buffer + 10, 2);
+	if (ISB <= BLOCK_INODE_TABLE || ISB > BLOCK_MAX || _block_bitmap[ISB] != '1')
+		ISB = 0;
+	else
+	{
+		diskIO(ISB, 1, _inode_sizes, 0);
+	}
 
-	if (block_number < 0 || block_number > BLOCK_MAX)
-		return 0;
+	// usage is kept once du has been used on this disk
+	UTB[0] = stoi(buffer + 16, 2);
+	UTB[1] = stoi(buffer + 18, 2);
+	if (UTB[0] <= BLOCK_INODE_TABLE || UTB[0] > BLOCK_MAX || _block_bitmap[UTB[0]] != '1' ||
+		UTB[1] <= BLOCK_INODE_TABLE || UTB[1] > BLOCK_MAX || _block_bitmap[UTB[1]] != '1')
+		UTB[0] = UTB[1] = 0;
+	else if (UTB[1] == UTB[0] + 1)
+		diskIO(UTB[0], 2, (char *)_usage_table, 0); // they follow each other; one read
+	else
+	{
+		diskIO(UTB[0], 1, (char *)_usage_table, 0);
+		diskIO(UTB[1], 1, (char *)_usage_table + SFS_BLOCK_SIZE, 0);
+	}
 
-	if (df == NULL)
-		mountSFS(); // trying to read without mounting...!!!
+	// files have more than one name only once ln has been used on this disk
+	LCB = stoi(buffer + 20, 2);
+	if (LCB <= BLOCK_INODE_TABLE || LCB > BLOCK_MAX || _block_bitmap[LCB] != '1')
+		LCB = 0;
+	else
+		diskIO(LCB, 1, _link_counts, 0);
 
-	fseek(df, block_number * 1024, SEEK_SET); // set file pointer at right position
-	fread(buffer, 1, 1024, df);				  // read a block, i.e. 1024 bytes into buffer
+	// blocks are shared between files only once cp --reflink has been used on this disk
+	SHB = stoi(buffer + 25, 2);
+	if (SHB <= BLOCK_INODE_TABLE || SHB > BLOCK_MAX || _block_bitmap[SHB] != '1')
+		SHB = 0;
+	else
+		diskIO(SHB, 1, _share_counts, 0);
+	computeShares();
 
-	return 1;
+	// blocks held by snapshots can not be handed out, even when the live file system has freed them
+	memset(_block_refcount, 0, sizeof(_block_refcount));
+	SNB = stoi(buffer + 8, 2);
+	if (SNB <= BLOCK_INODE_TABLE || SNB > BLOCK_MAX || _block_bitmap[SNB] != '1')
+		SNB = 0;
+	else
+	{
+		diskIO(SNB, 1, (char *)_snapshot_table, 0);
+		for (i = 0; i < SNAP_MAX; i++)
+		{
+			if (_snapshot_table[i].F != '1')
+				continue;
+			diskIO(stoi(_snapshot_table[i].MB[0], 2), 1, snap_bitmap, 0); // the block bitmap at the time of the snapshot
+			for (int b = BLOCK_INODE_TABLE + 1; b <= BLOCK_MAX; b++)
+			{
+				if (snap_bitmap[b] != '1')
+					continue;
+				if (_block_refcount[b]++ == 0 && _block_bitmap[b] == '0')
+					free_disk_blocks--;
+			}
+		}
+	}
+
+	// disks written before directory records existed still have four fixed entries per block
+	if (buffer[12] != '2')
+	{
+		convertDirectories();
+		readSFS(BLOCK_SUPER, buffer);
+		buffer[12] = '2';
+		writeSFS(BLOCK_SUPER, buffer);
+	}
 }
 
 /****************************************************************************/
-/* writes a block of data from buffer to disk file
-/* if buffer is null pointer, then writes all zeros
-/* returns 0 if invalid block number
+/* closes the image files; the next disk access mounts again
 /*
 /****************************************************************************/
 
-int writeSFS(int block_number, char buffer[1024])
+void unmountSFS()
 {
-	char empty_buffer[1024];
-
-	if (block_number < 0 || block_number > BLOCK_MAX)
-		return 0;
-
-	if (df == NULL)
-		mountSFS(); // trying to write without mounting...!!!
-
-	fseek(df, block_number * 1024, SEEK_SET); // set file pointer at right position
-
-	if (buffer == NULL)
-	{ // if buffer is null
-		memset(empty_buffer, '0', 1024);
-		fwrite(empty_buffer, 1, 1024, df); // write all zeros
-	}
-	else
-		fwrite(buffer, 1, 1024, df);
-
-	fflush(df); // making sure disk file is always updated
+	int i;
 
-	return 1;
+	for (i = 0; i < STRIPES; i++)
+		fclose(_stripe_files[i]);
+	df = NULL;
 }
 
-/*############################################################################*/
 /****************************************************************************/
-/* finds the first available block using the block bitmap
-/* updates the bitmap
-/* writes the block bitmap to disk file
-/* returns -1 on error; otherwise the block number
+/* makes a new, empty file system of <blocks> blocks in sfs.disk, with the
+/* block size the program was compiled for; everything on the old disk is
+/* lost, and image files it was striped over are deleted
+/* only the superblock, the bitmaps and the inode table are written; the
+/* rest of the disk file is left as a hole
 /*
 /****************************************************************************/
 
-int getBlock()
+void makeSFS(int blocks)
 {
+	char buffer[SFS_BLOCK_SIZE], name[32];
+	FILE *f;
 	int i;
 
-	if (free_disk_blocks == 0)
-		return -1;
+	if (blocks < BLOCK_INODE_TABLE + 2 || blocks > BLOCK_MAX + 1)
+	{
+		printf("Usage: mkfs [blocks, %d to %d]\n", BLOCK_INODE_TABLE + 2, BLOCK_MAX + 1);
+		return;
+	}
 
-	for (i = 0; i < BLB; i++)
-		if (_block_bitmap[i] == '0')
-			break; // 0 means available
+	if (df != NULL)
+	{
+		flushRun();
+		unmountSFS();
+	}
+	for (STRIPE_SET = 0; STRIPE_SET < 2; STRIPE_SET++)
+		for (i = 1; i < STRIPE_MAX; i++)
+		{
+			stripeName(name, i);
+			unlink(name);
+		}
+	STRIPE_SET = 0;
+	if ((f = fopen("sfs.disk", "wb")) == NULL)
+	{
+		printf("sfs.disk: %s\n", strerror(errno));
+		exit(1);
+	}
 
-	_block_bitmap[i] = '1';
-	free_disk_blocks--;
+	// superblock: sizes, no tables set up yet, packed directories, one image file, the block size, the first name set, no share table
+	memset(buffer, 0, SFS_BLOCK_SIZE);
+	sprintf(buffer, "%03d%03d0000002101000000%02d000", blocks, INODE_MAX + 1, SFS_BLOCK_SIZE / 1024);
+	fwrite(buffer, SFS_BLOCK_SIZE, 1, f);
 
-	writeSFS(BLOCK_BLOCK_BITMAP, _block_bitmap);
+	// block bitmap; the superblock, the two bitmaps and the inode table are in use
+	memset(buffer, '0', SFS_BLOCK_SIZE);
+	memset(buffer, '1', BLOCK_INODE_TABLE + 1);
+	fwrite(buffer, SFS_BLOCK_SIZE, 1, f);
 
-	return i;
+	// inode bitmap and inode table; only the root directory, which has no blocks yet
+	memset(buffer, '0', SFS_BLOCK_SIZE);
+	buffer[0] = '1';
+	fwrite(buffer, SFS_BLOCK_SIZE, 1, f);
+	memset(buffer, '0', SFS_BLOCK_SIZE);
+	strncpy(((_inode_entry *)buffer)->TT, "DI", 2);
+	fwrite(buffer, SFS_BLOCK_SIZE, 1, f);
+
+	fflush(f);
+	if (ftruncate(fileno(f), (long)blocks * SFS_BLOCK_SIZE) != 0)
+		printf("sfs.disk: %s\n", strerror(errno));
+	fclose(f);
+
+	mountSFS();
+	rd();
+	printf("Made a disk of %d blocks of %d bytes.\n", blocks, SFS_BLOCK_SIZE);
 }
 
 /****************************************************************************/
-/* updates block bitmap when a block is no longer used
-/* blocks 0 through 3 are treated special; so they are always in use
+/* puts the name of image file <i> in <name>; sfs.disk, then sfs.disk.1, ...
+/* or sfs.disk.b1, ... depending on the name set in use
 /*
 /****************************************************************************/
 
-void returnBlock(int index)
+void stripeName(char *name, int i)
 {
-	if (index > 3 && index <= BLOCK_MAX)
-	{
-		_block_bitmap[index] = '0';
-		free_disk_blocks++;
-
-		writeSFS(BLOCK_BLOCK_BITMAP, _block_bitmap);
-	}
+	if (i == 0)
+		strcpy(name, "sfs.disk");
+	else
+		sprintf(name, (STRIPE_SET ? "sfs.disk.b%d" : "sfs.disk.%d"), i);
 }
 
 /****************************************************************************/
-/* finds the first unused position in inode table using the inode bitmap
-/* updates the bitmap
-/* writes the inode bitmap to disk file
-/* returns -1 if table is full; otherwise the position
+/* reads (or writes if <write> is set) <n> blocks from block <block_number>
+/* on into buffer (or from it)
+/* the blocks a run puts in one image file follow each other in that file,
+/* so there is one read or write per image file however long the run is
+/* blocks past the end of an image file read as zeros
 /*
 /****************************************************************************/
 
-int getInode()
+void diskIO(int block_number, int n, char *buffer, int write)
 {
-	int i;
-
-	if (free_inode_entries == 0)
-		return -1;
+	char one[SFS_BLOCK_SIZE];
+	char *piece = (n == 1 ? one : (char *)malloc(n * SFS_BLOCK_SIZE));
+	int f, b, first, count;
 
-	for (i = 0; i < INB; i++)
-		if (_inode_bitmap[i] == '0')
-			break; // 0 means available
+	for (f = 0; f < STRIPES; f++)
+	{
+		first = -1;
+		count = 0;
+		for (b = block_number; b < block_number + n; b++)
+		{
+			if ((b / STRIPE_UNIT) % STRIPES != f)
+				continue; // in another image file
+			if (first == -1)
+				first = b;
+			if (write)
+				memcpy(piece + count * SFS_BLOCK_SIZE, buffer + (b - block_number) * SFS_BLOCK_SIZE, SFS_BLOCK_SIZE);
+			count++;
+		}
+		if (count == 0)
+			continue;
 
-	_inode_bitmap[i] = '1';
-	free_inode_entries--;
+		// where block <first> is in image file f
+		fseek(_stripe_files[f], ((first / STRIPE_UNIT / STRIPES) * STRIPE_UNIT + first % STRIPE_UNIT) * SFS_BLOCK_SIZE, SEEK_SET);
+		if (write)
+		{
+			fwrite(piece, SFS_BLOCK_SIZE, count, _stripe_files[f]);
+			fflush(_stripe_files[f]); // making sure disk file is always updated
+			continue;
+		}
 
-	writeSFS(BLOCK_INODE_BITMAP, _inode_bitmap);
+		memset(piece, 0, count * SFS_BLOCK_SIZE);
+		fread(piece, SFS_BLOCK_SIZE, count, _stripe_files[f]);
+		count = 0;
+		for (b = first; b < block_number + n; b++)
+			if ((b / STRIPE_UNIT) % STRIPES == f)
+				memcpy(buffer + (b - block_number) * SFS_BLOCK_SIZE, piece + SFS_BLOCK_SIZE * count++, SFS_BLOCK_SIZE);
+	}
 
-	return i;
+	if (piece != one)
+		free(piece);
 }
 
 /****************************************************************************/
-/* updates inode bitmap when an inode entry is no longer used
+/* zeros <n> blocks from block <block_number> on in the image files without
+/* sending them any data; if <punch> is set, the host file system may also
+/* take the space back, and the blocks read as zeros until written again
+/* returns 0 if the host file system can not do it; the blocks may then
+/* hold anything
 /*
 /****************************************************************************/
 
-void returnInode(int index)
+int diskZero(int block_number, int n, int punch)
 {
-	if (index > 0 && index <= INODE_MAX)
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_ZERO_RANGE)
+	int f, b, first, count, ok = 1;
+
+	for (f = 0; f < STRIPES; f++)
 	{
-		_inode_bitmap[index] = '0';
-		free_inode_entries++;
+		first = -1;
+		count = 0;
+		for (b = block_number; b < block_number + n; b++)
+		{
+			if ((b / STRIPE_UNIT) % STRIPES != f)
+				continue; // in another image file
+			if (first == -1)
+				first = b;
+			count++;
+		}
+		if (count == 0)
+			continue;
 
-		writeSFS(BLOCK_INODE_BITMAP, _inode_bitmap);
+		fflush(_stripe_files[f]); // nothing buffered may land on the range afterwards, or be read from it
+		if (fallocate(fileno(_stripe_files[f]), (punch ? FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE : FALLOC_FL_ZERO_RANGE),
+					  ((first / STRIPE_UNIT / STRIPES) * STRIPE_UNIT + first % STRIPE_UNIT) * SFS_BLOCK_SIZE, count * SFS_BLOCK_SIZE) != 0)
+			ok = 0;
 	}
-}
-
-/*############################################################################*/
-/****************************************************************************/
-/* makes root directory the current directory 
-/*
-/****************************************************************************/
 
-void rd()
-{
-	CD_INODE_ENTRY = 0; // first inode entry is for root directory
-	current_working_directory[0] = '/';
-	current_working_directory[1] = 0;
+	return ok;
+#else
+	return 0;
+#endif
 }
 
 /****************************************************************************/
-/* lists all files and directories in the current directory 
+/* stripes the disk over <n> image files, <unit> blocks at a time
+/* the other image files are written under the name set not in use, and
+/* sfs.disk as sfs.disk.new; renaming that over sfs.disk switches to the
+/* new layout in one step, so a crash before it leaves the old disk whole
+/* the image files of the old name set are deleted afterwards
 /*
 /****************************************************************************/
 
-void ls()
+void restripe(int n, int unit)
 {
-	char itype;
-	int blocks[3];
-	_directory_entry _directory_entries[4];
+	int nblocks = (BLB > BLOCK_MAX + 1 || BLB < 1) ? BLOCK_MAX + 1 : BLB;
+	char *image = (char *)malloc(nblocks * SFS_BLOCK_SIZE);
+	char name[32], zeros[SFS_BLOCK_SIZE];
+	long sizes[STRIPE_MAX] = {0};
+	FILE *f;
+	int i, b, len, old_stripes = STRIPES, old_set = STRIPE_SET;
 
-	int total_files = 0, total_dirs = 0;
+	if (n < 1 || n > STRIPE_MAX || unit < 1 || unit > 99)
+	{
+		printf("Usage: restripe <image files, 1 to %d> <blocks per stripe unit, 1 to 99>\n", STRIPE_MAX);
+		free(image);
+		return;
+	}
 
-	int i, j;
-	int e_inode;
+	flushRun();
+	diskIO(0, nblocks, image, 0);
+	image[13] = '0' + n;
+	itos(image + 14, unit, 2);
+	image[24] = (old_set ? '0' : '1');
 
-	// read inode entry for current directory
-	// in SFS, an inode can point to three blocks at the most
-	itype = _inode_table[CD_INODE_ENTRY].TT[0];
-	blocks[0] = stoi(_inode_table[CD_INODE_ENTRY].XX, 2);
-	blocks[1] = stoi(_inode_table[CD_INODE_ENTRY].YY, 2);
-	blocks[2] = stoi(_inode_table[CD_INODE_ENTRY].ZZ, 2);
+	unmountSFS();
+	STRIPES = n;
+	STRIPE_UNIT = unit;
+	STRIPE_SET = !old_set;
+	for (i = 0; i < n; i++)
+	{
+		if (i == 0)
+			strcpy(name, "sfs.disk.new");
+		else
+			stripeName(name, i);
+		if ((f = fopen(name, "w+b")) == NULL)
+		{
+			printf("%s: %s\n", name, strerror(errno));
+			exit(1);
+		}
+		_stripe_files[i] = f;
+	}
 
-	// its a directory; so the following should never happen
-	if (itype == 'F')
+	// only blocks holding something are written, a run at a time; the rest stay holes
+	memset(zeros, 0, SFS_BLOCK_SIZE);
+	for (b = 0; b < nblocks; b += len)
 	{
-		printf("Fatal Error! Aborting.\n");
+		for (len = 0; b + len < nblocks && memcmp(image + (b + len) * SFS_BLOCK_SIZE, zeros, SFS_BLOCK_SIZE) != 0; len++)
+			;
+		if (len == 0)
+			len = 1; // all zeros
+		else
+			diskIO(b, len, image + b * SFS_BLOCK_SIZE, 1);
+	}
+
+	// every image file as long as its share of the disk
+	for (b = 0; b < nblocks; b++)
+		sizes[(b / unit) % n] = ((b / unit / n) * unit + b % unit + 1) * (long)SFS_BLOCK_SIZE;
+	for (i = 0; i < n; i++)
+	{
+		if (i == 0)
+			strcpy(name, "sfs.disk.new");
+		else
+			stripeName(name, i);
+		if (ftruncate(fileno(_stripe_files[i]), sizes[i]) != 0)
+			printf("%s: %s\n", name, strerror(errno));
+		fsync(fileno(_stripe_files[i])); // all of the new layout is on disk before the switch
+		fclose(_stripe_files[i]);
+	}
+	if (rename("sfs.disk.new", "sfs.disk") != 0)
+	{
+		printf("sfs.disk: %s\n", strerror(errno));
 		exit(1);
 	}
 
-	// lets traverse the directory entries in all three blocks
-	for (i = 0; i < 3; i++)
+	STRIPE_SET = old_set;
+	for (i = 1; i < old_stripes; i++)
 	{
-		if (blocks[i] == 0)
-			continue; // 0 means pointing at nothing
+		stripeName(name, i);
+		unlink(name);
+	}
+	STRIPE_SET = !old_set;
+	free(image);
 
-		readSFS(blocks[i], (char *)_directory_entries); // lets read a directory entry; notice the cast
+	df = NULL;
+	mountSFS();
+	rd();
+	printf("Disk striped over %d image file%c, %d block%c per stripe unit.\n", n, (n == 1 ? 0 : 's'), unit, (unit == 1 ? 0 : 's'));
+}
 
-		// so, we got four possible directory entries now
-		for (j = 0; j < 4; j++)
-		{
-			if (_directory_entries[j].F == '0')
-				continue; // means unused entry
+/****************************************************************************/
+/* reads a block of data from disk file into buffer
+/* returns 0 if invalid block number
+/*
+/****************************************************************************/
 
-			e_inode = stoi(_directory_entries[j].MMM, 3); // this is the inode that has more info about this entry
+int readSFS(int block_number, char buffer[SFS_BLOCK_SIZE])
+{
+	int i;
 
-			if (_inode_table[e_inode].TT[0] == 'F')
-			{ // entry is for a file
-				printf("%s\t", _directory_entries[j].fname);
-				total_files++;
-			}
-			else if (_inode_table[e_inode].TT[0] == 'D')
-			{ // entry is for a directory; print it in BRED
-				printf("\x1B[31m%s\x1B[0m\t", _directory_entries[j].fname);
-				total_dirs++;
-			}
-		}
+	if (block_number < 0 || block_number > BLOCK_MAX)
+		return 0;
+
+	if (df == NULL)
+		mountSFS(); // trying to read without mounting...!!!
+
+	if ((i = cacheFind(block_number)) != -1)
+	{ // no need to go to the disk file
+		memcpy(buffer, _block_cache[i].data, SFS_BLOCK_SIZE);
+		cache_hits++;
+		return 1;
 	}
+	cache_misses++;
 
-	printf("\n%d file%c and %d director%s.\n", total_files, (total_files <= 1 ? 0 : 's'), total_dirs, (total_dirs <= 1 ? "y" : "ies"));
+	if (METADATA_BATCH && batchedTable(block_number) != NULL && _batch_dirty[block_number])
+	{ // the disk file is behind; the table in memory is current
+		memcpy(buffer, batchedTable(block_number), SFS_BLOCK_SIZE);
+		return 1;
+	}
+	if (run_len > 0 && block_number >= run_start && block_number < run_start + run_len)
+	{ // not written yet
+		memcpy(buffer, _run_data + (block_number - run_start) * SFS_BLOCK_SIZE, SFS_BLOCK_SIZE);
+		return 1;
+	}
+
+	diskIO(block_number, 1, buffer, 0); // read a block, i.e. SFS_BLOCK_SIZE bytes into buffer
+	cacheStore(block_number, buffer);
+
+	return 1;
 }
 
 /****************************************************************************/
-/* moves into the directory <dname> within the current directory if 
-/* it exists
+/* writes a block of data from buffer to disk file
+/* if buffer is null pointer, then writes all zeros; outside a batch the
+/* image file is asked to zero the block itself
+/* while a batch is open, the write is put off until the batch ends
+/* returns 0 if invalid block number
 /*
 /****************************************************************************/
 
-void cd(char *dname)
+int writeSFS(int block_number, char buffer[SFS_BLOCK_SIZE])
 {
-	char itype;
-	int blocks[3];
-	_directory_entry _directory_entries[4];
+	char empty_buffer[SFS_BLOCK_SIZE];
+	int zero = (buffer == NULL);
 
-	int i, j;
-	int e_inode;
+	if (block_number < 0 || block_number > BLOCK_MAX)
+		return 0;
 
-	char found = 0;
+	if (df == NULL)
+		mountSFS(); // trying to write without mounting...!!!
 
-	// read inode entry for current directory
-	// in SFS, an inode can point to three blocks at the most
-	itype = _inode_table[CD_INODE_ENTRY].TT[0];
-	blocks[0] = stoi(_inode_table[CD_INODE_ENTRY].XX, 2);
-	blocks[1] = stoi(_inode_table[CD_INODE_ENTRY].YY, 2);
-	blocks[2] = stoi(_inode_table[CD_INODE_ENTRY].ZZ, 2);
+	if (buffer == NULL)
+	{ // if buffer is null
+		memset(empty_buffer, 0, SFS_BLOCK_SIZE);
+		buffer = empty_buffer; // write all zeros
+	}
 
-	// its a directory; so the following should never happen
-	if (itype == 'F')
+	if (METADATA_BATCH && batchedTable(block_number) == buffer)
+	{ // the table stays in memory until the batch ends
+		_batch_dirty[block_number] = 1;
+	}
+	else if (METADATA_BATCH && block_number != BLOCK_SUPER)
+	{ // add the block to the run, or start a new run if it does not follow on
+		if (run_len > 0 && block_number >= run_start && block_number < run_start + run_len)
+			; // already in the run; just replace it
+		else
+		{
+			if (run_len == RUN_BLOCKS || (run_len > 0 && block_number != run_start + run_len))
+				flushRun();
+			if (run_len == 0)
+				run_start = block_number;
+			run_len++;
+		}
+		memcpy(_run_data + (block_number - run_start) * SFS_BLOCK_SIZE, buffer, SFS_BLOCK_SIZE);
+	}
+	else if (!zero || !diskZero(block_number, 1, 0))
 	{
-		printf("Fatal Error! Aborting.\n");
-		exit(1);
+		diskIO(block_number, 1, buffer, 1);
 	}
+	cacheStore(block_number, buffer);
 
-	// now lets try to see if a directory by the name already exists
-	for (i = 0; i < 3; i++)
-	{
-		if (blocks[i] == 0)
-			continue; // 0 means pointing at nothing
+	// keep the checksum of this block current; the superblock and the table itself are not covered
+	if (CSB != 0 && block_number != BLOCK_SUPER && block_number != CSB)
+		stampBlock(block_number, buffer);
 
-		readSFS(blocks[i], (char *)_directory_entries); // lets read a directory entry; notice the cast
+	return 1;
+}
 
-		// so, we got four possible directory entries now
-		for (j = 0; j < 4; j++)
-		{
-			if (_directory_entries[j].F == '0')
-				continue; // means unused entry
+/****************************************************************************/
+/* returns the in-memory table kept in block <block_number>; NULL if it is
+/* not a metadata block
+/*
+/****************************************************************************/
 
-			e_inode = stoi(_directory_entries[j].MMM, 3); // this is the inode that has more info about this entry
+char *batchedTable(int block_number)
+{
+	if (block_number == BLOCK_BLOCK_BITMAP)
+		return _block_bitmap;
+	if (block_number == BLOCK_INODE_BITMAP)
+		return _inode_bitmap;
+	if (block_number == BLOCK_INODE_TABLE)
+		return (char *)_inode_table;
+	if (CSB != 0 && block_number == CSB)
+		return _block_checksums;
+	if (ISB != 0 && block_number == ISB)
+		return _inode_sizes;
+	if (UTB[0] != 0 && block_number == UTB[0])
+		return (char *)_usage_table;
+	if (UTB[1] != 0 && block_number == UTB[1])
+		return (char *)_usage_table + SFS_BLOCK_SIZE;
+	if (LCB != 0 && block_number == LCB)
+		return _link_counts;
+	if (SHB != 0 && block_number == SHB)
+		return _share_counts;
 
-			if (_inode_table[e_inode].TT[0] == 'D')
-			{ // entry is for a directory; can't cd into a file, right?
-				if (strncmp(dname, _directory_entries[j].fname, 252) == 0)
-				{			   // and it is the one we are looking for
-					found = 1; // VOILA
-					break;
-				}
-			}
-		}
-		if (found)
-			break; // no need to search more
-	}
+	return NULL;
+}
 
-	if (found)
-	{
-		CD_INODE_ENTRY = e_inode;						// just keep track of which inode entry in the table corresponds to this directory
-		strncpy(current_working_directory, dname, 252); // can use it in the prompt
-	}
-	else
-	{
-		printf("%.252s: No such directory.\n", dname);
-	}
+/****************************************************************************/
+/* opens a write batch; batches can be nested and only the outermost one
+/* writes anything when it ends
+/* in a batch, bitmaps, the inode table and the other tables are written
+/* once at the end, and other blocks go out in runs of blocks that follow
+/* each other on disk, with one write per run
+/* if the program dies in a batch, the data may be on disk without the
+/* metadata pointing at it; fsck -r gives those blocks back
+/*
+/****************************************************************************/
+
+void beginBatch()
+{
+	METADATA_BATCH++;
 }
 
 /****************************************************************************/
-/* creates a new directory called <dname> in the current directory if the 
-/* name is not already taken and there is still space available
+/* writes the blocks gathered in the run to disk file with one write
 /*
 /****************************************************************************/
 
-void md(char *dname)
+void flushRun()
 {
-	char itype;
-	int blocks[3];
-	_directory_entry _directory_entries[4];
+	if (run_len == 0)
+		return;
 
-	int i, j;
+	diskIO(run_start, run_len, _run_data, 1);
+	run_len = 0;
+}
 
-	int empty_dblock = -1, empty_dentry = -1;
-	int empty_ientry;
+/****************************************************************************/
+/* closes a write batch; the outermost one writes the run and then every
+/* metadata block that changed, the checksum table last; only then are the
+/* blocks freed in the batch given back to the host file system
+/*
+/****************************************************************************/
 
-	// non-empty name
-	if (strlen(dname) == 0)
-	{
-		printf("Usage: md <directory name>\n");
+void endBatch()
+{
+	int i;
+
+	if (METADATA_BATCH == 0 || --METADATA_BATCH > 0)
 		return;
-	}
 
-	// do we have free inodes
-	if (free_inode_entries == 0)
+	flushRun(); // data before the metadata that points at it
+	for (i = 0; i <= BLOCK_MAX; i++)
 	{
-		printf("Error: Inode table is full.\n");
-		return;
+		if (_batch_dirty[i] && i != CSB && batchedTable(i) != NULL)
+		{
+			_batch_dirty[i] = 0;
+			writeSFS(i, batchedTable(i));
+		}
 	}
+	if (CSB != 0 && _batch_dirty[CSB])
+		writeSFS(CSB, _block_checksums);
+	memset(_batch_dirty, 0, sizeof(_batch_dirty));
 
-	// read inode entry for current directory
-	// in SFS, an inode can point to three blocks at the most
-	itype = _inode_table[CD_INODE_ENTRY].TT[0];
-	blocks[0] = stoi(_inode_table[CD_INODE_ENTRY].XX, 2);
-	blocks[1] = stoi(_inode_table[CD_INODE_ENTRY].YY, 2);
-	blocks[2] = stoi(_inode_table[CD_INODE_ENTRY].ZZ, 2);
-
-	// its a directory; so the following should never happen
-	if (itype == 'F')
+	for (i = 0; i <= BLOCK_MAX; i++)
 	{
-		printf("Fatal Error! Aborting.\n");
-		exit(1);
+		if (_punch_pending[i] && _block_bitmap[i] == '0' && _block_refcount[i] == 0)
+			punchBlock(i); // still free; nothing on disk points at it any more
+		_punch_pending[i] = 0;
 	}
+}
 
-	// now lets try to see if the name already exists
-	for (i = 0; i < 3; i++)
-	{
-		if (blocks[i] == 0)
-		{ // 0 means pointing at nothing
-			if (empty_dblock == -1)
-				empty_dblock = i; // we can later add a block if needed
-			continue;
-		}
+/*############################################################################*/
+/****************************************************************************/
+/* empties the block cache and forgets all readahead state
+/*
+/****************************************************************************/
 
-		readSFS(blocks[i], (char *)_directory_entries); // lets read a directory entry; notice the cast
+void cacheClear()
+{
+	int i;
 
-		// so, we got four possible directory entries now
-		for (j = 0; j < 4; j++)
-		{
-			if (_directory_entries[j].F == '0')
-			{ // means unused entry
-				if (empty_dentry == -1)
-				{
-					empty_dentry = j;
-					empty_dblock = i;
-				} // AAHA! lets keep a note of it, just in case we have to create the new directory
-				continue;
-			}
+	for (i = 0; i < CACHE_BLOCKS; i++)
+		_block_cache[i].block = -1;
+	for (i = 0; i < READAHEAD_STREAMS; i++)
+		_readahead_table[i].inode = -1;
+}
 
-			if (strncmp(dname, _directory_entries[j].fname, 252) == 0)
-			{ // compare with user given name
-				printf("%.252s: Already exists.\n", dname);
-				return;
-			}
-		}
-	}
-	// so directory name is new
+/****************************************************************************/
+/* returns the cache entry holding block <block_number>; -1 if not cached
+/*
+/****************************************************************************/
 
-	// if we did not find an empty directory entry and all three blocks are in use; then no new directory can be made
-	if (empty_dentry == -1 && empty_dblock == -1)
+int cacheFind(int block_number)
+{
+	int i;
+
+	for (i = 0; i < CACHE_BLOCKS; i++)
 	{
-		printf("Error: Maximum directory entries reached.\n");
-		return;
+		if (_block_cache[i].block == block_number)
+		{
+			_block_cache[i].used = ++cache_clock;
+			return i;
+		}
 	}
-	else
-	{ // otherwise
-		if (empty_dentry == -1)
-		{ // Great! didn't find an empty entry but not all three blocks have been used
-			empty_dentry = 0;
 
-			if ((blocks[empty_dblock] = getBlock()) == -1)
-			{ // first get a new block using the block bitmap
-				printf("Error: Disk is full.\n");
-				return;
-			}
+	return -1;
+}
 
-			writeSFS(blocks[empty_dblock], NULL); // write all zeros to the block (there may be junk from the past!)
+/****************************************************************************/
+/* puts the contents of block <block_number> into the cache, replacing the
+/* cached copy or else the entry used longest ago
+/*
+/****************************************************************************/
 
-			switch (empty_dblock)
-			{ // update the inode entry of current dir to reflect that we are using a new block
-			case 0:
-				itos(_inode_table[CD_INODE_ENTRY].XX, blocks[empty_dblock], 2);
-				break;
-			case 1:
-				itos(_inode_table[CD_INODE_ENTRY].YY, blocks[empty_dblock], 2);
-				break;
-			case 2:
-				itos(_inode_table[CD_INODE_ENTRY].ZZ, blocks[empty_dblock], 2);
-				break;
-			}
+void cacheStore(int block_number, char buffer[SFS_BLOCK_SIZE])
+{
+	int i, victim = 0;
+
+	for (i = 0; i < CACHE_BLOCKS; i++)
+	{
+		if (_block_cache[i].block == block_number)
+		{
+			victim = i;
+			break;
 		}
+		if (_block_cache[i].block == -1 || _block_cache[i].used < _block_cache[victim].used)
+			victim = i;
+		if (_block_cache[i].block == -1)
+			break;
+	}
 
-		// NOTE: all error checkings have already been done at this point!!
-		// time to put everything together
+	_block_cache[victim].block = block_number;
+	_block_cache[victim].used = ++cache_clock;
+	memcpy(_block_cache[victim].data, buffer, SFS_BLOCK_SIZE);
+}
 
-		empty_ientry = getInode(); // get an empty place in the inode table which will store info about blocks for this new directory
+/****************************************************************************/
+/* brings the n blocks in <blocks> into the cache
+/* blocks that follow each other on disk are read together with one read
+/*
+/****************************************************************************/
+
+void prefetchBlocks(int *blocks, int n)
+{
+	char *run = (char *)malloc(n * SFS_BLOCK_SIZE);
+	int i, j, k;
 
-		readSFS(blocks[empty_dblock], (char *)_directory_entries);   // read block of current directory where info on this new directory will be written
-		_directory_entries[empty_dentry].F = '1';					 // remember we found which directory entry is unused; well, set it to used now
-		strncpy(_directory_entries[empty_dentry].fname, dname, 252); // put the name in there
-		itos(_directory_entries[empty_dentry].MMM, empty_ientry, 3); // and the index of the inode that will hold info inside this directory
-		writeSFS(blocks[empty_dblock], (char *)_directory_entries);  // now write this block back to the disk
+	flushRun(); // blocks still waiting to be written would be read stale
 
-		strncpy(_inode_table[empty_ientry].TT, "DI", 2); // create the inode entry...first, its a directory, so DI
-		strncpy(_inode_table[empty_ientry].XX, "00", 2); // directory is just created; so no blocks assigned to it yet
-		strncpy(_inode_table[empty_ientry].YY, "00", 2);
-		strncpy(_inode_table[empty_ientry].ZZ, "00", 2);
+	for (i = 0; i < n; i = j)
+	{
+		j = i + 1;
+		if (blocks[i] <= 0 || blocks[i] > BLOCK_MAX || cacheFind(blocks[i]) != -1)
+			continue; // nothing there, or already cached
 
-		writeSFS(BLOCK_INODE_TABLE, (char *)_inode_table); // phew!! write the inode table back to the disk
+		while (j < n && blocks[j] == blocks[j - 1] + 1 && cacheFind(blocks[j]) == -1)
+			j++; // the run goes on
+
+		diskIO(blocks[i], j - i, run, 0);
+		for (k = i; k < j; k++)
+			cacheStore(blocks[k], run + (k - i) * SFS_BLOCK_SIZE);
+		blocks_read_ahead += j - i;
 	}
+
+	free(run);
 }
 
 /****************************************************************************/
-/* prints number of free blocks in the disk and free inode entries in the inode table
+/* called before blocks <slot> to <slot> + <nslots> - 1 of inode entry
+/* <inode> are read; reads them, and blocks after them if the file or
+/* directory is being read sequentially, into the cache in as few reads as possible
+/* the number of extra blocks doubles every time a read follows the previous
+/* one and drops back when it does not
 /*
 /****************************************************************************/
 
-void stats()
+void readAhead(int inode, int slot, int nslots)
 {
-	int blocks_free = BLB, inodes_free = INB;
+	static int next_state = 0;
+	_readahead_state *state = NULL;
+	int blocks[3], n = 0;
 	int i;
 
-	for (i = 0; i < BLB; i++)
-		blocks_free -= (_block_bitmap[i] - 48);
-	for (i = 0; i < INB; i++)
-		inodes_free -= (_inode_bitmap[i] - 48);
+	for (i = 0; i < READAHEAD_STREAMS; i++)
+		if (_readahead_table[i].inode == inode)
+			state = &_readahead_table[i];
 
-	printf("%d block%c free.\n", blocks_free, (blocks_free <= 1 ? 0 : 's'));
-	printf("%d inode entr%s free.\n", inodes_free, (inodes_free <= 1 ? "y" : "ies"));
+	if (state == NULL)
+	{ // start following this one; the states are reused in turn
+		state = &_readahead_table[next_state];
+		next_state = (next_state + 1) % READAHEAD_STREAMS;
+		state->inode = inode;
+		state->next = -1;
+		state->window = 0;
+	}
+
+	if (slot == state->next || slot == state->next - 1) // going on where the last read stopped, maybe in the same block
+		state->window = (state->window == 0 ? 1 : state->window * 2);
+	else
+		state->window = 0; // random access; only what is asked for
+	if (state->window > READAHEAD_MAX)
+		state->window = READAHEAD_MAX;
+	state->next = slot + nslots;
+
+	char *slots[3] = {_inode_table[inode].XX, _inode_table[inode].YY, _inode_table[inode].ZZ};
+	for (i = slot; i < 3 && i < slot + nslots + state->window; i++)
+		blocks[n++] = stoi(slots[i], 2);
+
+	prefetchBlocks(blocks, n);
 }
-int display_file(char *fname)
-{
-	char itype;
-	int blocks[3];
-	_directory_entry _directory_entries[4];
 
-	int total_files = 0, total_dirs = 0;
+/*############################################################################*/
+/****************************************************************************/
+/* finds the first available block using the block bitmap
+/* updates the bitmap
+/* writes the block bitmap to disk file
+/* returns -1 on error; otherwise the block number
+/*
+/****************************************************************************/
 
-	int i, j;
-	int e_inode;
+int getBlock()
+{
+	int i;
 
-	// read inode entry for current directory
-	// in SFS, an inode can point to three blocks at the most
-	itype = _inode_table[CD_INODE_ENTRY].TT[0];
-	blocks[0] = stoi(_inode_table[CD_INODE_ENTRY].XX, 2);
-	blocks[1] = stoi(_inode_table[CD_INODE_ENTRY].YY, 2);
-	blocks[2] = stoi(_inode_table[CD_INODE_ENTRY].ZZ, 2);
-	//printf("%s\n",_inode_table[CD_INODE_ENTRY].YY);
-	// its a directory; so the following should never happen
-	if (itype == 'F')
-	{
-		printf("Fatal Error! Aborting.\n");
-		exit(1);
-	}
+	if (free_disk_blocks == 0)
+		return -1;
 
-	// lets traverse the directory entries in all three blocks
-	for (i = 0; i < 3; i++)
-	{
-		if (blocks[i] == 0)
-			continue; // 0 means pointing at nothing
+	for (i = 0; i < BLB; i++)
+		if (_block_bitmap[i] == '0' && _block_refcount[i] == 0)
+			break; // 0 means available; unless a snapshot still holds it
 
-		readSFS(blocks[i], (char *)_directory_entries); // lets read a directory entry; notice the cast
+	if (i == BLB)
+		return -1;
 
-		// so, we got four possible directory entries now
-		for (j = 0; j < 4; j++)
-		{
-			if (_directory_entries[j].F == '0')
-				continue; // means unused entry
+	takeBlock(i);
 
-			e_inode = stoi(_directory_entries[j].MMM, 3); // this is the inode that has more info about this entry
+	return i;
+}
 
-			if (_inode_table[e_inode].TT[0] == 'F' && !strcmp(_directory_entries[j].fname, fname))
-			{ // entry is for a file
-				char buf[1024];
-				int data_block[3];
-				data_block[0] = stoi(_inode_table[e_inode].XX, 2);
-				data_block[1] = stoi(_inode_table[e_inode].YY, 2);
-				data_block[2] = stoi(_inode_table[e_inode].ZZ, 2);
-				for (int db = 0; db < 3; db++)
+/****************************************************************************/
+/* marks block <index> as used if it is available
+/* writes the block bitmap to disk file
+/* returns 0 if the block is in use or a snapshot still holds it
+/*
+/****************************************************************************/
+
+int takeBlock(int index)
+{
+	if (index <= BLOCK_INODE_TABLE || index >= BLB || _block_bitmap[index] != '0' || _block_refcount[index] != 0)
+		return 0;
+
+	_block_bitmap[index] = '1';
+	_block_shares[index] = 1;
+	free_disk_blocks--;
+
+	writeSFS(BLOCK_BLOCK_BITMAP, _block_bitmap);
+
+	return 1;
+}
+
+/****************************************************************************/
+/* updates block bitmap when a block is no longer used
+/* once no snapshot holds the block either, its space is given back to the
+/* host file system (unless PUNCH_HOLES is 0)
+/* blocks 0 through 3 are treated special; so they are always in use
+/*
+/****************************************************************************/
+
+void returnBlock(int index)
+{
+	if (index > 3 && index <= BLOCK_MAX)
+	{
+		_block_bitmap[index] = '0';
+		_block_shares[index] = 0;
+		if (_block_refcount[index] == 0)
+		{ // otherwise it only becomes free once no snapshot holds it
+			free_disk_blocks++;
+			punchBlock(index);
+		}
+
+		writeSFS(BLOCK_BLOCK_BITMAP, _block_bitmap);
+	}
+}
+
+/****************************************************************************/
+/* gives the space of free block <index> back to the host file system; it
+/* then reads as zeros, and its checksum and cached copy say so too
+/* in a write batch, that waits until the batch has written the metadata,
+/* as the old metadata on disk may still point at the block
+/* does nothing if PUNCH_HOLES is 0
+/*
+/****************************************************************************/
+
+void punchBlock(int index)
+{
+	char zeros[SFS_BLOCK_SIZE];
+
+	if (!PUNCH_HOLES)
+		return;
+	if (METADATA_BATCH > 0)
+	{
+		_punch_pending[index] = 1;
+		return;
+	}
+	if (run_len > 0 && index >= run_start && index < run_start + run_len)
+		return; // a block still waiting in the run would only be written back
+	if (!diskZero(index, 1, 1))
+		return;
+
+	memset(zeros, 0, SFS_BLOCK_SIZE);
+	if (cacheFind(index) != -1)
+		cacheStore(index, zeros);
+	if (CSB != 0)
+		stampBlock(index, zeros);
+}
+
+/****************************************************************************/
+/* finds the first unused position in inode table using the inode bitmap
+/* updates the bitmap
+/* writes the inode bitmap to disk file
+/* returns -1 if table is full; otherwise the position
+/*
+/****************************************************************************/
+
+int getInode()
+{
+	int i;
+
+	if (free_inode_entries == 0)
+		return -1;
+
+	for (i = 0; i < INB; i++)
+		if (_inode_bitmap[i] == '0')
+			break; // 0 means available
+
+	_inode_bitmap[i] = '1';
+	free_inode_entries--;
+
+	writeSFS(BLOCK_INODE_BITMAP, _inode_bitmap);
+
+	return i;
+}
+
+/****************************************************************************/
+/* updates inode bitmap when an inode entry is no longer used
+/*
+/****************************************************************************/
+
+void returnInode(int index)
+{
+	if (index > 0 && index <= INODE_MAX)
+	{
+		_inode_bitmap[index] = '0';
+		free_inode_entries++;
+
+		writeSFS(BLOCK_INODE_BITMAP, _inode_bitmap);
+	}
+}
+
+/*############################################################################*/
+/****************************************************************************/
+/* records the checksum of the block contents in buffer in the checksum table
+/* writes the checksum table to disk file
+/*
+/****************************************************************************/
+
+void stampBlock(int block_number, char buffer[SFS_BLOCK_SIZE])
+{
+	char st[9];
+
+	sprintf(st, "%08x", crc32c(buffer, SFS_BLOCK_SIZE));
+	strncpy(_block_checksums + block_number * 8, st, 8);
+
+	writeSFS(CSB, _block_checksums);
+}
+
+/****************************************************************************/
+/* checks the whole disk for consistency:
+/*   - block checksums (if the checksum table is set up)
+/*   - directory records pointing at bad or already seen inode entries
+/*   - block numbers in inode entries that are out of range or used twice;
+/*     a data block may be used by as many files as the share table says
+/*   - block and inode bitmaps against what the directory tree really uses
+/* the disk is read with one sequential read instead of block by block
+/* if repair is set, problems are fixed and the checksum table is (re)built
+/*
+/****************************************************************************/
+
+void fsck(int repair)
+{
+	int nblocks = (BLB > BLOCK_MAX + 1 || BLB < 0) ? BLOCK_MAX + 1 : BLB;
+	int ninodes = (INB > INODE_MAX + 1 || INB < 0) ? INODE_MAX + 1 : INB;
+	int block_refs[BLOCK_MAX + 1] = {0};
+	char block_dirty[BLOCK_MAX + 1] = {0};
+	char reachable[INODE_MAX + 1] = {0};
+	char meta[BLOCK_MAX + 1] = {0}; // checksum table, snapshot table and snapshot copies
+	char dir_block_seen[BLOCK_MAX + 1] = {0}; // blocks used by a directory; files may share blocks, directories may not
+	int links[INODE_MAX + 1] = {0};
+	int stack[INODE_MAX + 1], top = 0;
+	int cross[3 * (INODE_MAX + 1)], ncross = 0; // inode entry * 3 + slot for every block number found cross-linked
+	int problems = 0, inode_table_dirty = 0, restamp = 0;
+	char *image;
+	char st[9];
+	int i, j, b;
+
+	if (nblocks != BLB || ninodes != INB)
+	{
+		printf("superblock: %d blocks and %d inode entries; checking only %d and %d.\n", BLB, INB, nblocks, ninodes);
+		problems++;
+	}
+
+	meta[CSB] = meta[SNB] = meta[ISB] = meta[UTB[0]] = meta[UTB[1]] = meta[LCB] = meta[SHB] = 1;
+	for (i = 0; i < SNAP_MAX; i++)
+	{
+		if (SNB == 0 || _snapshot_table[i].F != '1')
+			continue;
+		for (j = 0; j < 8; j++)
+			if ((b = stoi(_snapshot_table[i].MB[j], 2)) > 0 && b <= BLOCK_MAX)
+				meta[b] = 1;
+	}
+	meta[0] = 0;
+
+	// one big sequential read of the whole disk, per image file
+	image = (char *)malloc(nblocks * SFS_BLOCK_SIZE);
+	memset(image, 0, nblocks * SFS_BLOCK_SIZE);
+	diskIO(0, nblocks, image, 0);
+
+	// checksums are checked first, against what is on disk right now
+	if (CSB != 0)
+	{
+		for (b = 1; b < nblocks; b++)
+		{
+			if (b == CSB)
+				continue;
+			sprintf(st, "%08x", crc32c(image + b * SFS_BLOCK_SIZE, SFS_BLOCK_SIZE));
+			if (strncmp(st, _block_checksums + b * 8, 8) != 0)
+			{
+				printf("block %d: checksum mismatch.\n", b);
+				problems++;
+				restamp = 1;
+			}
+		}
+	}
+
+	// walk the directory tree from the root
+	if (_inode_table[0].TT[0] != 'D')
+	{
+		printf("Fatal: root inode entry is not a directory; giving up.\n");
+		free(image);
+		return;
+	}
+	reachable[0] = 1;
+	stack[top++] = 0;
+	while (top > 0)
+	{
+		int ino = stack[--top];
+		char *slots[3] = {_inode_table[ino].XX, _inode_table[ino].YY, _inode_table[ino].ZZ};
+
+		for (i = 0; i < 3; i++)
+		{
+			b = stoi(slots[i], 2);
+			if (b == 0)
+				continue; // 0 means pointing at nothing
+
+			if (b <= BLOCK_INODE_TABLE || b >= nblocks || meta[b] || (block_refs[b] > 0 && (dir_block_seen[b] || _inode_table[ino].TT[0] == 'D')))
+			{ // either garbage or a block some other inode entry already owns
+				printf("inode %d: bad block number %.2s.\n", ino, slots[i]);
+				problems++;
+				if (repair)
 				{
-					memset(buf, 0, 1024);
-					//printf("%d\n",data_block[db]);
-					if (data_block[db] != 0 && readSFS(data_block[db], buf))
+					strncpy(slots[i], "00", 2);
+					inode_table_dirty = 1;
+				}
+				continue;
+			}
+			if (block_refs[b] >= recordedShares(b))
+			{ // more files use it than it was ever shared with
+				printf("inode %d: block %d is also used by another file.\n", ino, b);
+				problems++;
+				cross[ncross++] = ino * 3 + i;
+				continue;
+			}
+			block_refs[b]++;
+
+			if (_inode_table[ino].TT[0] != 'D')
+				continue; // file data; nothing more to follow
+			dir_block_seen[b] = 1;
+
+			char *dir_block = image + b * SFS_BLOCK_SIZE;
+			char name[252];
+			int pos = 0, prev_pos = 0, e_inode;
+			while (nextRecord(dir_block, &pos, &e_inode, name))
+			{
+				if (e_inode <= 0 || e_inode >= ninodes || (reachable[e_inode] && _inode_table[e_inode].TT[0] != 'F') ||
+					(_inode_table[e_inode].TT[0] != 'F' && _inode_table[e_inode].TT[0] != 'D'))
+				{ // e.g. a half created entry or a second name for a directory
+					printf("directory inode %d: entry %.252s points at bad inode entry %.3s.\n", ino, name, dir_block + prev_pos);
+					problems++;
+					if (repair)
 					{
-						printf("%s", buf);
+						removeRecord(dir_block, prev_pos);
+						block_dirty[b] = 1;
+						pos = prev_pos; // the next record moved down here
 					}
+					else
+						prev_pos = pos;
+					continue;
 				}
-				printf("\n");
-				return 1;
+				if (links[e_inode]++ == 0)
+					stack[top++] = e_inode; // a file with more names is followed once
+				reachable[e_inode] = 1;
+				prev_pos = pos;
+			}
+
+			// whatever follows the last record has to read as the end marker
+			if (pos + DIR_HEADER <= SFS_BLOCK_SIZE && stoi(dir_block + pos + 3, 3) > 0)
+			{
+				printf("directory inode %d: block %d has garbage after its last record.\n", ino, b);
+				problems++;
+				if (repair)
+				{
+					memset(dir_block + pos, '0', SFS_BLOCK_SIZE - pos);
+					block_dirty[b] = 1;
+				}
+			}
+		}
+	}
+
+	// link counts against the names really found
+	for (i = 1; i < ninodes; i++)
+	{
+		if (reachable[i] && _inode_table[i].TT[0] == 'F' && links[i] != linkCount(i))
+		{
+			printf("inode %d: %d name%s but a link count of %d.\n", i, links[i], (links[i] == 1 ? "" : "s"), linkCount(i));
+			problems++;
+		}
+	}
+
+	// share counts against the files really using each block
+	for (b = BLOCK_INODE_TABLE + 1; b < nblocks; b++)
+	{
+		if (block_refs[b] > 0 && recordedShares(b) > block_refs[b])
+		{
+			printf("block %d: shared by %d files but used by %d.\n", b, recordedShares(b), block_refs[b]);
+			problems++;
+		}
+	}
+
+	// compare the bitmaps with what the tree really uses
+	for (b = 0; b < nblocks; b++)
+	{
+		char used = (b <= BLOCK_INODE_TABLE || meta[b] || block_refs[b] > 0) ? '1' : '0';
+		if (_block_bitmap[b] != used)
+		{
+			if (used == '1')
+				printf("block %d: in use but marked free.\n", b);
+			else
+				printf("block %d: marked used but nothing points at it.\n", b);
+			problems++;
+			if (repair)
+				_block_bitmap[b] = used;
+		}
+	}
+	for (i = 0; i < ninodes; i++)
+	{
+		char used = reachable[i] ? '1' : '0';
+		if (_inode_bitmap[i] != used)
+		{
+			if (used == '1')
+				printf("inode %d: in use but marked free.\n", i);
+			else
+				printf("inode %d: marked used but not in any directory.\n", i);
+			problems++;
+			if (repair)
+				_inode_bitmap[i] = used;
+		}
+	}
+
+	// usage kept for every file and directory against what really is below it
+	if (UTB[0] != 0)
+	{
+		_usage_entry *expected = (_usage_entry *)malloc(sizeof(_usage_table));
+		computeUsage(expected);
+		for (i = 0; i < ninodes; i++)
+		{
+			if (reachable[i] && memcmp(&expected[i], &_usage_table[i], sizeof(_usage_entry)) != 0)
+			{
+				printf("inode %d: usage is off.\n", i);
+				problems++;
+			}
+		}
+		free(expected);
+	}
+
+	if (!repair)
+	{
+		printf("%d problem%s found.\n", problems, (problems == 1 ? "" : "s"));
+		free(image);
+		return;
+	}
+
+	// write back everything that was fixed
+	for (b = 0; b < nblocks; b++)
+		if (block_dirty[b])
+			writeSFS(b, image + b * SFS_BLOCK_SIZE);
+	if (inode_table_dirty)
+		writeSFS(BLOCK_INODE_TABLE, (char *)_inode_table);
+	writeSFS(BLOCK_BLOCK_BITMAP, _block_bitmap);
+	writeSFS(BLOCK_INODE_BITMAP, _inode_bitmap);
+
+	free_disk_blocks = BLB;
+	for (i = 0; i < BLB; i++)
+		free_disk_blocks -= (_block_bitmap[i] - 48);
+	free_inode_entries = INB;
+	for (i = 0; i < INB; i++)
+		free_inode_entries -= (_inode_bitmap[i] - 48);
+
+	for (i = 0; i < ncross; i++)
+	{ // the file that came later gets a copy of its own; both keep their data
+		char *slot = (cross[i] % 3 == 0 ? _inode_table[cross[i] / 3].XX : (cross[i] % 3 == 1 ? _inode_table[cross[i] / 3].YY : _inode_table[cross[i] / 3].ZZ));
+		if ((b = getBlock()) == -1)
+			strncpy(slot, "00", 2); // no room for a copy
+		else
+		{
+			writeSFS(b, image + stoi(slot, 2) * SFS_BLOCK_SIZE);
+			itos(slot, b, 2);
+		}
+	}
+	if (ncross > 0)
+		writeSFS(BLOCK_INODE_TABLE, (char *)_inode_table);
+
+	for (i = 1; i < ninodes; i++)
+		if (reachable[i] && _inode_table[i].TT[0] == 'F' && links[i] != linkCount(i))
+			setLinkCount(i, links[i]);
+	computeShares();
+	if (SHB != 0)
+	{ // recorded again from what the repaired tree shares
+		for (b = 0; b <= BLOCK_MAX; b++)
+			itos(_share_counts + b * 3, (_block_shares[b] > 1 ? _block_shares[b] : 0), 3);
+		writeSFS(SHB, _share_counts);
+	}
+	if (UTB[0] != 0)
+	{ // worked out again over the repaired tree
+		computeUsage(_usage_table);
+		saveUsage(3);
+	}
+
+	if (CSB == 0)
+	{ // first repair on this disk; set up the checksum table
+		char buffer[SFS_BLOCK_SIZE];
+
+		b = getBlock();
+		if (b == -1 || b > BLOCK_MAX)
+		{
+			if (b != -1)
+			{ // beyond what the disk file can address; give it back
+				_block_bitmap[b] = '0';
+				free_disk_blocks++;
+				writeSFS(BLOCK_BLOCK_BITMAP, _block_bitmap);
 			}
+			printf("No free block for the checksum table; checksums stay off.\n");
+		}
+		else
+		{
+			readSFS(BLOCK_SUPER, buffer);
+			itos(buffer + 6, b, 2);
+			writeSFS(BLOCK_SUPER, buffer);
+			CSB = b;
+			restamp = 1;
+		}
+	}
+
+	if (restamp)
+	{ // contents on disk are taken as good from now on
+		diskIO(0, nblocks, image, 0);
+		memset(_block_checksums, '0', SFS_BLOCK_SIZE);
+		for (b = 1; b < nblocks; b++)
+		{
+			sprintf(st, "%08x", crc32c(image + b * SFS_BLOCK_SIZE, SFS_BLOCK_SIZE));
+			strncpy(_block_checksums + b * 8, st, 8);
 		}
+		writeSFS(CSB, _block_checksums);
+	}
+
+	printf("%d problem%s found and repaired.\n", problems, (problems == 1 ? "" : "s"));
+	free(image);
+}
+
+/*############################################################################*/
+/****************************************************************************/
+/* reads the directory record at byte *pos of directory block <block>
+/* puts its inode entry index in *e_inode (-1 if garbage) and its name in name
+/* returns 0 if there are no more records; otherwise moves *pos to the next one
+/*
+/****************************************************************************/
+
+int nextRecord(char block[SFS_BLOCK_SIZE], int *pos, int *e_inode, char name[252])
+{
+	_directory_record *record = (_directory_record *)(block + *pos);
+	int rlen, nlen;
+
+	if (*pos + DIR_HEADER > SFS_BLOCK_SIZE)
+		return 0; // no room left for another record
+
+	rlen = stoi(record->RRR, 3);
+	nlen = stoi(record->NNN, 3);
+	if (rlen <= 0 || nlen < 0 || nlen > 251 || rlen < DIR_HEADER + nlen || *pos + rlen > SFS_BLOCK_SIZE)
+		return 0; // end marker, or something that is not a record
+
+	*e_inode = stoi(record->MMM, 3);
+	memcpy(name, block + *pos + DIR_HEADER, nlen);
+	name[nlen] = 0;
+	*pos += rlen;
+
+	return 1;
+}
+
+/****************************************************************************/
+/* returns the number of bytes used by the records in directory block <block>
+/* which is also where the next record would go
+/*
+/****************************************************************************/
+
+int recordsEnd(char block[SFS_BLOCK_SIZE])
+{
+	int pos = 0, e_inode;
+	char name[252];
+
+	while (nextRecord(block, &pos, &e_inode, name))
+		;
+
+	return pos;
+}
+
+/****************************************************************************/
+/* adds a record for <name> with inode entry index <e_inode> at the end of
+/* directory block <block>
+/* returns 0 if it does not fit
+/*
+/****************************************************************************/
+
+int addRecord(char block[SFS_BLOCK_SIZE], char *name, int e_inode)
+{
+	int pos = recordsEnd(block);
+	int nlen = strlen(name);
+	_directory_record *record = (_directory_record *)(block + pos);
+
+	if (nlen > 251 || pos + DIR_HEADER + nlen > SFS_BLOCK_SIZE)
+		return 0;
+
+	itos(record->MMM, e_inode, 3);
+	itos(record->RRR, DIR_HEADER + nlen, 3);
+	itos(record->NNN, nlen, 3);
+	memcpy(block + pos + DIR_HEADER, name, nlen);
+
+	pos += DIR_HEADER + nlen;
+	if (pos + DIR_HEADER <= SFS_BLOCK_SIZE)
+		memset(block + pos, '0', DIR_HEADER); // end marker
+
+	return 1;
+}
+
+/****************************************************************************/
+/* removes the record starting at byte <pos> from directory block <block>
+/* the records after it are moved down so the block stays packed
+/*
+/****************************************************************************/
+
+void removeRecord(char block[SFS_BLOCK_SIZE], int pos)
+{
+	int used = recordsEnd(block);
+	int rlen = stoi(((_directory_record *)(block + pos))->RRR, 3);
+
+	memmove(block + pos, block + pos + rlen, used - pos - rlen);
+	memset(block + used - rlen, '0', SFS_BLOCK_SIZE - (used - rlen));
+}
+
+/****************************************************************************/
+/* rewrites every directory block of the live file system and of all
+/* snapshots from four fixed entries to packed directory records
+/* a block never holds more records than it had entries, so it is done in place
+/* the format flag is only set once every block is done; if mounting stops
+/* half way, blocks already converted are recognised and left alone the
+/* next time
+/*
+/****************************************************************************/
+
+void convertDirectories()
+{
+	static _inode_entry tables[SNAP_MAX + 1][SFS_BLOCK_SIZE / sizeof(_inode_entry)];
+	static char bitmaps[SNAP_MAX + 1][SFS_BLOCK_SIZE];
+	char done[BLOCK_MAX + 1] = {0};
+	char old_block[SFS_BLOCK_SIZE], new_block[SFS_BLOCK_SIZE];
+	_directory_entry *old_entries = (_directory_entry *)old_block; // the old format had four entries in the first 1024 bytes
+	int ntables = 1;
+	int t, i, j, k, b;
+
+	printf("Converting directories to packed records.\n");
+
+	memcpy(tables[0], _inode_table, sizeof(_inode_table));
+	memcpy(bitmaps[0], _inode_bitmap, SFS_BLOCK_SIZE);
+	for (i = 0; i < SNAP_MAX && SNB != 0; i++)
+	{
+		if (_snapshot_table[i].F != '1')
+			continue;
+		readSFS(stoi(_snapshot_table[i].MB[1], 2), bitmaps[ntables]);
+		readSFS(stoi(_snapshot_table[i].MB[2], 2), (char *)tables[ntables++]);
+	}
+
+	for (t = 0; t < ntables; t++)
+	{
+		for (i = 0; i <= INODE_MAX; i++)
+		{
+			if (bitmaps[t][i] != '1' || tables[t][i].TT[0] != 'D')
+				continue;
+
+			char *slots[3] = {tables[t][i].XX, tables[t][i].YY, tables[t][i].ZZ};
+			for (k = 0; k < 3; k++)
+			{
+				b = stoi(slots[k], 2);
+				if (b <= BLOCK_INODE_TABLE || b > BLOCK_MAX || done[b])
+					continue; // nothing there, or shared with an inode entry already done
+				done[b] = 1;
+
+				readSFS(b, old_block);
+				if (isConverted(old_block))
+					continue; // done before mounting was cut short
+				memset(new_block, '0', SFS_BLOCK_SIZE);
+				for (j = 0; j < 4; j++)
+				{
+					if (old_entries[j].F != '1')
+						continue;
+
+					old_entries[j].fname[251] = 0;
+					int pos = recordsEnd(new_block);
+					if (!addRecord(new_block, old_entries[j].fname, 0))
+					{ // only if all four names are close to 252 characters long
+						printf("Warning: name %.32s... in block %d is too long to keep; shortened.\n", old_entries[j].fname, b);
+						old_entries[j].fname[SFS_BLOCK_SIZE - pos - DIR_HEADER] = 0;
+						addRecord(new_block, old_entries[j].fname, 0);
+					}
+					memcpy(((_directory_record *)(new_block + pos))->MMM, old_entries[j].MMM, 3); // as is, even if broken
+				}
+				writeSFS(b, new_block);
+			}
+		}
+	}
+}
+
+/****************************************************************************/
+/* returns 1 if directory block <block> looks like convertDirectories wrote
+/* it: records with names free of null characters, then nothing but '0'
+/* an old block with a used entry never passes, since the null character
+/* ending its name would be in a record name or after the records
+/*
+/****************************************************************************/
+
+int isConverted(char block[SFS_BLOCK_SIZE])
+{
+	char name[252];
+	int pos = 0, start = 0, e_inode;
+
+	while (nextRecord(block, &pos, &e_inode, name))
+	{
+		if ((int)strlen(name) != stoi(((_directory_record *)(block + start))->NNN, 3))
+			return 0; // a null character in the name
+		start = pos;
+	}
+
+	for (; pos < SFS_BLOCK_SIZE; pos++)
+		if (block[pos] != '0')
+			return 0;
+
+	return 1;
+}
+
+/****************************************************************************/
+/* sets up <cursor> to walk directory <inode> from its first entry
+/*
+/****************************************************************************/
+
+void openDir(_dir_cursor *cursor, int inode)
+{
+	cursor->inode = inode;
+	cursor->slot = 0;
+	cursor->pos = 0;
+}
+
+/****************************************************************************/
+/* puts up to <max> entries of the directory in <items>, going on from
+/* where <cursor> is, and moves the cursor past them
+/* returns the number of entries; 0 once all of them have been handed out
+/* records after one that is removed move down, so a walk over a directory
+/* that is changing may miss entries
+/*
+/****************************************************************************/
+
+int readDir(_dir_cursor *cursor, _dir_item *items, int max)
+{
+	char *slots[3] = {_inode_table[cursor->inode].XX, _inode_table[cursor->inode].YY, _inode_table[cursor->inode].ZZ};
+	char dir_block[SFS_BLOCK_SIZE];
+	int n = 0, b, e_inode;
+
+	if (cursor->slot == 0 && cursor->pos == 0)
+		readAhead(cursor->inode, 0, 3); // a walk nearly always goes through the whole directory
+
+	for (; cursor->slot < 3 && n < max; cursor->slot++, cursor->pos = 0)
+	{
+		if ((b = stoi(slots[cursor->slot], 2)) <= 0)
+			continue; // 0 means pointing at nothing
+
+		readSFS(b, dir_block);
+		while (n < max && nextRecord(dir_block, &cursor->pos, &e_inode, items[n].name))
+		{
+			if (e_inode <= 0 || (_inode_table[e_inode].TT[0] != 'F' && _inode_table[e_inode].TT[0] != 'D'))
+				continue; // broken record; fsck will deal with it
+			items[n].inode = e_inode;
+			items[n].type = _inode_table[e_inode].TT[0];
+			n++;
+		}
+		if (n == max)
+			break; // there may be more in this block
+	}
+
+	return n;
+}
+
+/*############################################################################*/
+/****************************************************************************/
+/* makes sure block number <slot> (0, 1 or 2) of inode entry <inode> can be
+/* written in place; if a snapshot or another file (see cp --reflink) still
+/* holds that block, its contents are copied to a new block which replaces
+/* it in the inode entry
+/* returns -1 if the disk is full; otherwise the block number to write to
+/*
+/****************************************************************************/
+
+int cowBlock(int inode, int slot)
+{
+	char buffer[SFS_BLOCK_SIZE];
+	char *slots[3] = {_inode_table[inode].XX, _inode_table[inode].YY, _inode_table[inode].ZZ};
+	int old_block = stoi(slots[slot], 2), new_block, owner;
+
+	if (old_block <= 0 || (_block_refcount[old_block] == 0 && _block_shares[old_block] <= 1))
+		return old_block; // nobody else sees this block
+
+	if ((new_block = getBlock()) == -1)
+		return -1;
+
+	owner = shareOwner(old_block, -1); // the one whose usage counts the old block
+	readSFS(old_block, buffer);
+	writeSFS(new_block, buffer);
+	itos(slots[slot], new_block, 2);
+	writeSFS(BLOCK_INODE_TABLE, (char *)_inode_table);
+	if (_block_shares[old_block] > 1)
+	{ // another file still uses it; the new block and the old one are both counted now
+		setShares(old_block, _block_shares[old_block] - 1);
+		addUsage((owner == inode ? shareOwner(old_block, -1) : inode), 0, 1, 0);
+	}
+	else
+		returnBlock(old_block); // the snapshot keeps it
+
+	return new_block;
+}
+
+/****************************************************************************/
+/* returns 1 (and complains) if a snapshot is mounted; 0 otherwise
+/*
+/****************************************************************************/
+
+int isReadOnly()
+{
+	if (SNAP_MOUNTED == -1)
+		return 0;
+
+	printf("Error: snapshot %.15s is mounted read-only; use \"snap umount\" first.\n", _snapshot_table[SNAP_MOUNTED].sname);
+	return 1;
+}
+
+/****************************************************************************/
+/* takes a snapshot called <sname> of the whole file system
+/* only the bitmaps, inode table and file size table are copied; every
+/* block the snapshot can see is held until the snapshot is removed
+/*
+/****************************************************************************/
+
+void snapCreate(char *sname)
+{
+	char buffer[SFS_BLOCK_SIZE];
+	int blocks[8];
+	int copies = 3 + (ISB != 0) + 2 * (UTB[0] != 0) + (LCB != 0) + (SHB != 0);
+	int i, j, b, empty_sentry = -1;
+
+	if (strlen(sname) == 0 || strlen(sname) > 14)
+	{
+		printf("Usage: snap create <name of at most 14 characters>\n");
+		return;
+	}
+
+	if (SNB == 0)
+	{ // first snapshot on this disk; set up the snapshot table
+		if ((b = getBlock()) == -1)
+		{
+			printf("Error: Disk is full.\n");
+			return;
+		}
+		memset(_snapshot_table, '0', sizeof(_snapshot_table));
+		writeSFS(b, (char *)_snapshot_table);
+		readSFS(BLOCK_SUPER, buffer);
+		itos(buffer + 8, b, 2);
+		writeSFS(BLOCK_SUPER, buffer);
+		SNB = b;
+	}
+
+	for (i = 0; i < SNAP_MAX; i++)
+	{
+		if (_snapshot_table[i].F != '1')
+		{
+			if (empty_sentry == -1)
+				empty_sentry = i;
+			continue;
+		}
+		if (strncmp(sname, _snapshot_table[i].sname, 15) == 0)
+		{
+			printf("%.15s: Already exists.\n", sname);
+			return;
+		}
+	}
+
+	if (empty_sentry == -1)
+	{
+		printf("Error: Maximum number of snapshots reached.\n");
+		return;
+	}
+	if (free_disk_blocks < copies)
+	{
+		printf("Error: Disk is full.\n");
+		return;
+	}
+
+	for (j = 0; j < 8; j++)
+	{ // tables that are not kept yet get no copy
+		if (j < 3 || (j == 3 && ISB != 0) || ((j == 4 || j == 5) && UTB[0] != 0) || (j == 6 && LCB != 0) || (j == 7 && SHB != 0))
+			blocks[j] = getBlock();
+		else
+			blocks[j] = 0;
+	}
+
+	_snapshot_table[empty_sentry].F = '1';
+	strncpy(_snapshot_table[empty_sentry].sname, sname, 15);
+	for (j = 0; j < 8; j++)
+		itos(_snapshot_table[empty_sentry].MB[j], blocks[j], 2);
+
+	// the snapshot holds everything the live file system uses, except the tables that only belong to the live one
+	memcpy(buffer, _block_bitmap, SFS_BLOCK_SIZE);
+	if (CSB != 0)
+		buffer[CSB] = '0';
+	if (ISB != 0)
+		buffer[ISB] = '0';
+	if (UTB[0] != 0)
+		buffer[UTB[0]] = buffer[UTB[1]] = '0';
+	if (LCB != 0)
+		buffer[LCB] = '0';
+	if (SHB != 0)
+		buffer[SHB] = '0';
+	buffer[SNB] = '0';
+	for (i = 0; i < SNAP_MAX; i++)
+	{
+		if (_snapshot_table[i].F != '1')
+			continue;
+		for (j = 0; j < 8; j++)
+			if ((b = stoi(_snapshot_table[i].MB[j], 2)) > 0)
+				buffer[b] = '0';
+	}
+
+	writeSFS(blocks[0], buffer);
+	writeSFS(blocks[1], _inode_bitmap);
+	writeSFS(blocks[2], (char *)_inode_table);
+	if (ISB != 0)
+		writeSFS(blocks[3], _inode_sizes);
+	if (UTB[0] != 0)
+	{
+		writeSFS(blocks[4], (char *)_usage_table);
+		writeSFS(blocks[5], (char *)_usage_table + SFS_BLOCK_SIZE);
+	}
+	if (LCB != 0)
+		writeSFS(blocks[6], _link_counts);
+	if (SHB != 0)
+		writeSFS(blocks[7], _share_counts);
+	writeSFS(SNB, (char *)_snapshot_table); // only now the snapshot exists
+
+	for (b = BLOCK_INODE_TABLE + 1; b <= BLOCK_MAX; b++)
+		if (buffer[b] == '1')
+			_block_refcount[b]++;
+}
+
+/****************************************************************************/
+/* lists all snapshots with the number of blocks only they still hold
+/*
+/****************************************************************************/
+
+void snapList()
+{
+	char buffer[SFS_BLOCK_SIZE];
+	int total_snaps = 0;
+	int i, b;
+
+	for (i = 0; i < SNAP_MAX && SNB != 0; i++)
+	{
+		if (_snapshot_table[i].F != '1')
+			continue;
+
+		int held = 0;
+		readSFS(stoi(_snapshot_table[i].MB[0], 2), buffer);
+		for (b = BLOCK_INODE_TABLE + 1; b <= BLOCK_MAX; b++)
+			if (buffer[b] == '1' && _block_bitmap[b] == '0')
+				held++;
+
+		printf("%.15s\t%d block%c held%s\n", _snapshot_table[i].sname, held, (held == 1 ? 0 : 's'), (i == SNAP_MOUNTED ? " (mounted)" : ""));
+		total_snaps++;
+	}
+
+	printf("%d snapshot%c.\n", total_snaps, (total_snaps == 1 ? 0 : 's'));
+}
+
+/****************************************************************************/
+/* mounts snapshot <sname> read-only in place of the live file system
+/*
+/****************************************************************************/
+
+void snapMount(char *sname)
+{
+	int i;
+
+	if (SNAP_MOUNTED != -1)
+	{
+		printf("Error: snapshot %.15s is already mounted.\n", _snapshot_table[SNAP_MOUNTED].sname);
+		return;
+	}
+
+	for (i = 0; i < SNAP_MAX && SNB != 0; i++)
+	{
+		if (_snapshot_table[i].F == '1' && strncmp(sname, _snapshot_table[i].sname, 15) == 0)
+		{
+			readSFS(stoi(_snapshot_table[i].MB[0], 2), _block_bitmap);
+			readSFS(stoi(_snapshot_table[i].MB[1], 2), _inode_bitmap);
+			readSFS(stoi(_snapshot_table[i].MB[2], 2), (char *)_inode_table);
+			ISB = stoi(_snapshot_table[i].MB[3], 2); // 0 if sizes were not kept yet
+			if (ISB != 0)
+				readSFS(ISB, _inode_sizes);
+			if ((LCB = stoi(_snapshot_table[i].MB[6], 2)) > 0)
+				readSFS(LCB, _link_counts);
+			else
+				LCB = 0;
+			if ((SHB = stoi(_snapshot_table[i].MB[7], 2)) > 0)
+				readSFS(SHB, _share_counts);
+			else
+				SHB = 0;
+			computeShares();
+			UTB[0] = stoi(_snapshot_table[i].MB[4], 2);
+			UTB[1] = stoi(_snapshot_table[i].MB[5], 2);
+			if (UTB[0] > 0 && UTB[1] > 0)
+			{
+				readSFS(UTB[0], (char *)_usage_table);
+				readSFS(UTB[1], (char *)_usage_table + SFS_BLOCK_SIZE);
+			}
+			else
+			{ // usage was not kept yet; work it out, just in memory
+				UTB[0] = UTB[1] = 0;
+				computeUsage(_usage_table);
+			}
+			SNAP_MOUNTED = i;
+			rd();
+			return;
+		}
+	}
+
+	printf("%.15s: No such snapshot.\n", sname);
+}
+
+/****************************************************************************/
+/* goes back to the live file system
+/*
+/****************************************************************************/
+
+void snapUmount()
+{
+	if (SNAP_MOUNTED == -1)
+	{
+		printf("Error: no snapshot is mounted.\n");
+		return;
+	}
+
+	unmountSFS(); // simply mount the live file system again
+	SNAP_MOUNTED = -1;
+	mountSFS();
+	rd();
+}
+
+/****************************************************************************/
+/* removes snapshot <sname>; blocks only it still held become free
+/*
+/****************************************************************************/
+
+void snapRemove(char *sname)
+{
+	char buffer[SFS_BLOCK_SIZE];
+	int i, j, b;
+
+	for (i = 0; i < SNAP_MAX && SNB != 0; i++)
+	{
+		if (_snapshot_table[i].F != '1' || strncmp(sname, _snapshot_table[i].sname, 15) != 0)
+			continue;
+
+		readSFS(stoi(_snapshot_table[i].MB[0], 2), buffer);
+		_snapshot_table[i].F = '0';
+		writeSFS(SNB, (char *)_snapshot_table); // the snapshot is gone from here on
+
+		for (b = BLOCK_INODE_TABLE + 1; b <= BLOCK_MAX; b++)
+			if (buffer[b] == '1' && --_block_refcount[b] == 0 && _block_bitmap[b] == '0')
+			{
+				free_disk_blocks++;
+				punchBlock(b);
+			}
+		for (j = 0; j < 8; j++)
+			if ((b = stoi(_snapshot_table[i].MB[j], 2)) > 0)
+				returnBlock(b);
+		return;
+	}
+
+	printf("%.15s: No such snapshot.\n", sname);
+}
+
+/*############################################################################*/
+/****************************************************************************/
+/* fills <table> with the usage of every file and directory, found by
+/* walking the whole tree from the root
+/* the walk works in a table of its own, as it still needs the directory
+/* the usage table names for each file when <table> is that table
+/*
+/****************************************************************************/
+
+void computeUsage(_usage_entry *table)
+{
+	_usage_entry *fresh = (_usage_entry *)malloc(sizeof(_usage_table));
+	char seen[INODE_MAX + 1] = {0};
+
+	memset(fresh, '0', sizeof(_usage_table));
+	usageWalk(fresh, seen, 0, 0);
+	memcpy(table, fresh, sizeof(_usage_table));
+	free(fresh);
+}
+
+/****************************************************************************/
+/* works out the usage of inode entry <inode>, which is in directory
+/* <parent>, and of everything below it
+/* a file with more than one name is counted once, in the directory its
+/* entry in the usage table names if that still has it; other entries
+/* already seen are skipped, as only a broken tree has them
+/* a block files share (see cp --reflink) is counted once, for the lowest
+/* inode entry using it
+/*
+/****************************************************************************/
+
+void usageWalk(_usage_entry *table, char *seen, int inode, int parent)
+{
+	char *slots[3] = {_inode_table[inode].XX, _inode_table[inode].YY, _inode_table[inode].ZZ};
+	_dir_cursor cursor;
+	_dir_item items[8];
+	int bytes = 0, blocks = 0, files = 0;
+	int i, n, e, b, home;
+
+	seen[inode] = 1;
+	for (i = 0; i < 3; i++)
+		if ((b = stoi(slots[i], 2)) > 0 && (_block_shares[b] <= 1 || shareOwner(b, -1) == inode))
+			blocks++;
+
+	if (_inode_table[inode].TT[0] == 'F')
+	{
+		bytes = file_size(inode);
+		files = 1;
+	}
+	else
+	{
+		openDir(&cursor, inode);
+		while ((n = readDir(&cursor, items, 8)) > 0)
+		{
+			for (i = 0; i < n; i++)
+			{
+				if (seen[e = items[i].inode])
+					continue;
+				home = stoi(_usage_table[e].PPP, 3);
+				if (items[i].type == 'F' && linkCount(e) > 1 && home != inode && dirLinks(home, e))
+					continue; // counted in the directory it was made in
+				usageWalk(table, seen, e, inode);
+				bytes += stoi(table[e].BYTES, 7);
+				blocks += stoi(table[e].BLK, 3);
+				files += stoi(table[e].FIL, 3);
+			}
+		}
+	}
+
+	itos(table[inode].PPP, parent, 3);
+	itos(table[inode].BYTES, bytes, 7);
+	itos(table[inode].BLK, blocks, 3);
+	itos(table[inode].FIL, files, 3);
+}
+
+/****************************************************************************/
+/* sets up the usage table on a disk that does not keep usage yet
+/* returns 0 if there is no room for it
+/*
+/****************************************************************************/
+
+int setupUsage()
+{
+	char buffer[SFS_BLOCK_SIZE];
+	int b0, b1;
+
+	if ((b0 = getBlock()) == -1)
+		return 0;
+	if ((b1 = getBlock()) == -1)
+	{
+		returnBlock(b0);
+		return 0;
+	}
+
+	computeUsage(_usage_table);
+	UTB[0] = b0;
+	UTB[1] = b1;
+	saveUsage(3);
+
+	readSFS(BLOCK_SUPER, buffer);
+	itos(buffer + 16, b0, 2);
+	itos(buffer + 18, b1, 2);
+	writeSFS(BLOCK_SUPER, buffer);
+
+	return 1;
+}
+
+/****************************************************************************/
+/* writes the halves of the usage table set in <halves> (1 for entries 0 to
+/* 63, 2 for the rest) to disk file, if usage is kept
+/*
+/****************************************************************************/
+
+void saveUsage(int halves)
+{
+	if (UTB[0] == 0 || SNAP_MOUNTED != -1)
+		return;
+
+	if (halves & 1)
+		writeSFS(UTB[0], (char *)_usage_table);
+	if (halves & 2)
+		writeSFS(UTB[1], (char *)_usage_table + SFS_BLOCK_SIZE);
+}
+
+/****************************************************************************/
+/* starts the usage of new inode entry <inode> in directory <parent> at 0
+/*
+/****************************************************************************/
+
+void setParent(int inode, int parent)
+{
+	memset(&_usage_table[inode], '0', sizeof(_usage_entry));
+	itos(_usage_table[inode].PPP, parent, 3);
+	saveUsage(inode < USAGE_PER_BLOCK ? 1 : 2);
+}
+
+/****************************************************************************/
+/* adds <bytes>, <blocks> and <files> (which may be negative) to the usage
+/* of inode entry <inode> and of every directory above it
+/*
+/****************************************************************************/
+
+void addUsage(int inode, int bytes, int blocks, int files)
+{
+	int halves = 0, i = inode, n, v;
+
+	for (n = 0; n <= INODE_MAX && i >= 0 && i <= INODE_MAX; n++)
+	{
+		v = stoi(_usage_table[i].BYTES, 7) + bytes;
+		itos(_usage_table[i].BYTES, (v < 0 ? 0 : v), 7);
+		v = stoi(_usage_table[i].BLK, 3) + blocks;
+		itos(_usage_table[i].BLK, (v < 0 ? 0 : v), 3);
+		v = stoi(_usage_table[i].FIL, 3) + files;
+		itos(_usage_table[i].FIL, (v < 0 ? 0 : v), 3);
+		halves |= (i < USAGE_PER_BLOCK ? 1 : 2);
+
+		if (i == 0)
+			break; // the root is its own parent
+		i = stoi(_usage_table[i].PPP, 3);
+	}
+
+	saveUsage(halves);
+}
+
+/****************************************************************************/
+/* takes the usage of inode entry <inode>, which is going away, off every
+/* directory above it
+/*
+/****************************************************************************/
+
+void dropUsage(int inode)
+{
+	int parent = stoi(_usage_table[inode].PPP, 3);
+
+	if (inode != 0 && parent >= 0)
+		addUsage(parent, -stoi(_usage_table[inode].BYTES, 7), -stoi(_usage_table[inode].BLK, 3), -stoi(_usage_table[inode].FIL, 3));
+	memset(&_usage_table[inode], '0', sizeof(_usage_entry));
+	saveUsage(inode < USAGE_PER_BLOCK ? 1 : 2);
+}
+
+/****************************************************************************/
+/* moves the usage of inode entry <inode> from the directories above it to
+/* directory <parent> and the directories above that
+/*
+/****************************************************************************/
+
+void moveUsage(int inode, int parent)
+{
+	int bytes = stoi(_usage_table[inode].BYTES, 7), blocks = stoi(_usage_table[inode].BLK, 3), files = stoi(_usage_table[inode].FIL, 3);
+
+	addUsage(stoi(_usage_table[inode].PPP, 3), -bytes, -blocks, -files);
+	itos(_usage_table[inode].PPP, parent, 3);
+	addUsage(parent, bytes, blocks, files);
+}
+
+/*############################################################################*/
+/****************************************************************************/
+/* counts how many inode entries of the file system use every block
+/*
+/****************************************************************************/
+
+void computeShares()
+{
+	int i, k, b;
+
+	memset(_block_shares, 0, sizeof(_block_shares));
+	for (i = 0; i <= INODE_MAX; i++)
+	{
+		if (_inode_bitmap[i] != '1')
+			continue;
+		char *slots[3] = {_inode_table[i].XX, _inode_table[i].YY, _inode_table[i].ZZ};
+		for (k = 0; k < 3; k++)
+			if ((b = stoi(slots[k], 2)) > 0 && b <= BLOCK_MAX)
+				_block_shares[b]++;
+	}
+}
+
+/****************************************************************************/
+/* returns the number of inode entries the share table says may use block
+/* <b>; 1 if it is not shared
+/*
+/****************************************************************************/
+
+int recordedShares(int b)
+{
+	int n;
+
+	if (SHB == 0 || (n = stoi(_share_counts + b * 3, 3)) <= 1)
+		return 1;
+	return n;
+}
+
+/****************************************************************************/
+/* sets the number of inode entries using block <b> to <n>, and keeps it in
+/* the share table if it is more than 1 (or was)
+/* sets up the share table when a block is shared for the first time
+/* returns 0 if there is no room for the table
+/*
+/****************************************************************************/
+
+int setShares(int b, int n)
+{
+	char buffer[SFS_BLOCK_SIZE];
+	int t;
+
+	if (SHB == 0)
+	{
+		if (n <= 1)
+		{
+			_block_shares[b] = n;
+			return 1; // nothing to keep yet
+		}
+		if ((t = getBlock()) == -1)
+			return 0;
+		memset(_share_counts, '0', SFS_BLOCK_SIZE);
+		SHB = t;
+		writeSFS(SHB, _share_counts);
+		readSFS(BLOCK_SUPER, buffer);
+		itos(buffer + 25, t, 2);
+		writeSFS(BLOCK_SUPER, buffer);
+	}
+
+	_block_shares[b] = n;
+	if (recordedShares(b) != (n > 1 ? n : 1))
+	{
+		itos(_share_counts + b * 3, (n > 1 ? n : 0), 3);
+		writeSFS(SHB, _share_counts);
+	}
+
+	return 1;
+}
+
+/****************************************************************************/
+/* returns the lowest inode entry other than <skip> that uses block <b>;
+/* the usage of that one counts a shared block; -1 if there is none
+/*
+/****************************************************************************/
+
+int shareOwner(int b, int skip)
+{
+	int i;
+
+	for (i = 0; i <= INODE_MAX; i++)
+	{
+		if (i == skip || _inode_bitmap[i] != '1')
+			continue;
+		if (stoi(_inode_table[i].XX, 2) == b || stoi(_inode_table[i].YY, 2) == b || stoi(_inode_table[i].ZZ, 2) == b)
+			return i;
+	}
+
+	return -1;
+}
+
+/****************************************************************************/
+/* returns the number of directory records pointing at inode entry <inode>
+/*
+/****************************************************************************/
+
+int linkCount(int inode)
+{
+	int n;
+
+	if (LCB == 0 || (n = stoi(_link_counts + inode * 3, 3)) <= 0)
+		return 1;
+	return n;
+}
+
+/****************************************************************************/
+/* sets the link count of inode entry <inode> to <n>
+/* sets up the link count table on first use
+/* returns 0 if there is no room for the table
+/*
+/****************************************************************************/
+
+int setLinkCount(int inode, int n)
+{
+	char buffer[SFS_BLOCK_SIZE];
+	int b, i;
+
+	if (LCB == 0)
+	{
+		if (n == 1)
+			return 1; // nothing to keep yet
+		if ((b = getBlock()) == -1)
+			return 0;
+		memset(_link_counts, '0', SFS_BLOCK_SIZE);
+		for (i = 0; i <= INODE_MAX; i++)
+			itos(_link_counts + i * 3, 1, 3);
+		LCB = b;
+		writeSFS(LCB, _link_counts);
+		readSFS(BLOCK_SUPER, buffer);
+		itos(buffer + 20, b, 2);
+		writeSFS(BLOCK_SUPER, buffer);
+	}
+
+	itos(_link_counts + inode * 3, n, 3);
+	writeSFS(LCB, _link_counts);
+
+	return 1;
+}
+
+/****************************************************************************/
+/* returns the directory last seen with a record pointing at inode entry
+/* <inode> other than the one its usage is counted in; it may have lost
+/* that record since, so check with dirLinks; -1 if none is kept
+/*
+/****************************************************************************/
+
+int otherParent(int inode)
+{
+	if (LCB == 0)
+		return -1;
+	return stoi(_link_counts + (INODE_MAX + 1 + inode) * 3, 3);
+}
+
+/****************************************************************************/
+/* keeps <dir> as the other directory with a record for inode entry <inode>
+/*
+/****************************************************************************/
+
+void setOtherParent(int inode, int dir)
+{
+	if (LCB == 0)
+		return;
+	itos(_link_counts + (INODE_MAX + 1 + inode) * 3, dir, 3);
+	writeSFS(LCB, _link_counts);
+}
+
+/****************************************************************************/
+/* returns 1 if directory <dir> has a record pointing at inode entry <e_inode>
+/*
+/****************************************************************************/
+
+int dirLinks(int dir, int e_inode)
+{
+	_dir_cursor cursor;
+	_dir_item items[8];
+	int i, n;
+
+	if (dir < 0 || dir > INODE_MAX || _inode_table[dir].TT[0] != 'D')
+		return 0;
+
+	openDir(&cursor, dir);
+	while ((n = readDir(&cursor, items, 8)) > 0)
+		for (i = 0; i < n; i++)
+			if (items[i].inode == e_inode)
+				return 1;
+
+	return 0;
+}
+
+/****************************************************************************/
+/* returns a directory at or below directory <dir> that has a record
+/* pointing at inode entry <e_inode>; -1 if there is none
+/*
+/****************************************************************************/
+
+int findParent(int dir, int e_inode)
+{
+	_dir_cursor cursor;
+	_dir_item items[8];
+	int i, n, p;
+
+	if (dirLinks(dir, e_inode))
+		return dir;
+
+	openDir(&cursor, dir);
+	while ((n = readDir(&cursor, items, 8)) > 0)
+		for (i = 0; i < n; i++)
+			if (items[i].type == 'D' && (p = findParent(items[i].inode, e_inode)) != -1)
+				return p;
+
+	return -1;
+}
+
+/*############################################################################*/
+/****************************************************************************/
+/* starts recording every command given, with when it was given, how long
+/* it took and the content typed for it, to trace file <fname>
+/*
+/****************************************************************************/
+
+void traceStart(char *fname)
+{
+	if (trace_file != NULL)
+	{
+		printf("Error: already tracing.\n");
+		return;
+	}
+	if (strlen(fname) == 0)
+	{
+		printf("Usage: trace start <file>\n");
+		return;
+	}
+	if ((trace_file = fopen(fname, "wb")) == NULL)
+	{
+		printf("%s: %s\n", fname, strerror(errno));
+		return;
+	}
+
+	fwrite("SFSTRAC2", 1, 8, trace_file); // format 2; SFSTRACE traces had a 32 bit usec
+	trace_start = nowMicros();
+	trace_ops = 0;
+}
+
+/****************************************************************************/
+/* stops recording
+/*
+/****************************************************************************/
+
+void traceStop()
+{
+	if (trace_file == NULL)
+	{
+		printf("Error: not tracing.\n");
+		return;
+	}
+
+	fclose(trace_file);
+	trace_file = NULL;
+	printf("%d command%c recorded.\n", trace_ops, (trace_ops == 1 ? 0 : 's'));
+}
+
+/****************************************************************************/
+/* records command line <line>, given at <start> and taking <latency>
+/* microseconds, with the content typed for it
+/* trace and replay commands are not recorded
+/*
+/****************************************************************************/
+
+void traceRecord(char *line, long start, long latency)
+{
+	_trace_record record;
+	int len = strcspn(line, "\n");
+
+	if (!strncmp(line, "trace", 5) || !strncmp(line, "replay", 6))
+		return;
+
+	memset(&record, 0, sizeof(record)); // no stray bytes in the padding
+	record.usec = start - trace_start;
+	record.latency = latency;
+	record.line_len = len;
+	record.input_len = trace_input_len;
+	fwrite(&record, sizeof(record), 1, trace_file);
+	fwrite(line, 1, len, trace_file);
+	fwrite(trace_input, 1, trace_input_len, trace_file);
+	trace_ops++;
+}
+
+/****************************************************************************/
+/* reads the next record of a trace file written in format <version> into
+/* <record>; format 1 files start with SFSTRACE, format 2 with SFSTRAC2
+/* returns 0 at the end of the file
+/*
+/****************************************************************************/
+
+int readTraceRecord(FILE *tf, int version, _trace_record *record)
+{
+	_trace_record_v1 old;
+
+	if (version == 2)
+		return fread(record, sizeof(*record), 1, tf) == 1;
+
+	if (fread(&old, sizeof(old), 1, tf) != 1)
+		return 0;
+	record->usec = old.usec;
+	record->latency = old.latency;
+	record->input_len = old.input_len;
+	record->line_len = old.line_len;
+	return 1;
+}
+
+/****************************************************************************/
+/* orders latencies for qsort
+/*
+/****************************************************************************/
+
+int compareLatency(const void *a, const void *b)
+{
+	return (*(long *)a > *(long *)b) - (*(long *)a < *(long *)b);
+}
+
+/****************************************************************************/
+/* runs the commands recorded in trace file <fname> against the mounted disk
+/* as fast as possible, or with the recorded time between them if <timed>
+/* is set, and reports throughput and latency next to the recorded latency
+/* ls pages are all listed, since answers to the more prompt are not recorded
+/*
+/****************************************************************************/
+
+void replayTrace(char *fname, int timed)
+{
+	FILE *tf;
+	_trace_record record;
+	char magic[8] = {0}, line[1024], input[FILE_MAX];
+	long *latencies = NULL, start, op_start, total = 0, recorded = 0;
+	int n = 0, room = 0, version;
+
+	if (strlen(fname) == 0)
+	{
+		printf("Usage: replay <file> [-t]\n");
+		return;
+	}
+	if ((tf = fopen(fname, "rb")) == NULL)
+	{
+		printf("%s: %s\n", fname, strerror(errno));
+		return;
+	}
+	if (fread(magic, 1, 8, tf) != 8 || strncmp(magic, "SFSTRAC", 7) != 0)
+	{
+		printf("%s: Not a trace file.\n", fname);
+		fclose(tf);
+		return;
+	}
+	version = (magic[7] == 'E' ? 1 : magic[7] - '0');
+	if (version != 1 && version != 2)
+	{
+		printf("%s: Trace format %c is unknown.\n", fname, magic[7]);
+		fclose(tf);
+		return;
+	}
+
+	start = nowMicros();
+	while (readTraceRecord(tf, version, &record))
+	{
+		if (record.line_len > 1023 || record.input_len > FILE_MAX ||
+			fread(line, 1, record.line_len, tf) != record.line_len || fread(input, 1, record.input_len, tf) != record.input_len)
+		{
+			printf("%s: Trace is cut short or broken.\n", fname);
+			break;
+		}
+		line[record.line_len] = '\0';
+		if (!strncmp(line, "exit", 4))
+			continue; // the replay goes on
+
+		if (timed && nowMicros() - start < (long)record.usec)
+			usleep(record.usec - (nowMicros() - start)); // the user was thinking
+
+		replay_input = input;
+		replay_input_len = record.input_len;
+		replay_input_pos = 0;
+		op_start = nowMicros();
+		run_command(line);
+		if (n == room)
+			latencies = (long *)realloc(latencies, (room = room * 2 + 64) * sizeof(long));
+		latencies[n] = nowMicros() - op_start;
+		total += latencies[n++];
+		recorded += record.latency;
+	}
+	replay_input = NULL;
+	fclose(tf);
+
+	if (n == 0)
+	{
+		printf("No commands replayed.\n");
+		free(latencies);
+		return;
+	}
+
+	double secs = (nowMicros() - start) / 1e6;
+	qsort(latencies, n, sizeof(long), compareLatency);
+	printf("\n%d command%c replayed in %.3f s, %.0f commands/s.\n", n, (n == 1 ? 0 : 's'), secs, (secs > 0 ? n / secs : 0));
+	printf("Latency in us: average %ld, median %ld, 99th percentile %ld, max %ld; recorded average %ld.\n",
+		   total / n, latencies[n / 2], latencies[(n * 99) / 100], latencies[n - 1], recorded / n);
+	free(latencies);
+}
+
+/*############################################################################*/
+/****************************************************************************/
+/* makes root directory the current directory 
+/*
+/****************************************************************************/
+
+void rd()
+{
+	CD_INODE_ENTRY = 0; // first inode entry is for root directory
+	current_working_directory[0] = '/';
+	current_working_directory[1] = 0;
+}
+
+/****************************************************************************/
+/* asks the user whether to go on after a page of output
+/* returns 0 if the user wants to stop; always 1 while replaying a trace
+/*
+/****************************************************************************/
+
+int morePrompt()
+{
+	char answer[64];
+
+	if (replay_input != NULL)
+		return 1; // answers were not recorded
+
+	printf("\n-- more (Enter to go on, q to stop) --");
+	if (fgets(answer, 64, stdin) == NULL || answer[0] == 'q')
+		return 0;
+	return 1;
+}
+
+/****************************************************************************/
+/* lists all files and directories in the current directory
+/* if <sorted> is set, they are listed by name
+/* if <page> is not 0, it waits for the user after every <page> entries
+/* at most a page (or LS_BATCH) of entries is held in memory at any time; a
+/* sorted page is found by walking the whole directory for the entries
+/* that come right after the last one listed
+/*
+/****************************************************************************/
+
+void ls(int sorted, int page)
+{
+	int batch = (page > 0 ? page : LS_BATCH);
+	_dir_item *items = (_dir_item *)malloc(batch * sizeof(_dir_item));
+	_dir_item scan[LS_BATCH];
+	_dir_cursor cursor;
+	char last[252] = "";
+
+	int total_files = 0, total_dirs = 0;
+
+	int i, j, k, n;
+
+	// its a directory; so the following should never happen
+	if (_inode_table[CD_INODE_ENTRY].TT[0] == 'F')
+	{
+		printf("Fatal Error! Aborting.\n");
+		exit(1);
+	}
+
+	openDir(&cursor, CD_INODE_ENTRY);
+	while (1)
+	{
+		if (!sorted)
+			n = readDir(&cursor, items, batch); // just the next ones, in the order they are stored
+		else
+		{ // the <batch> smallest names after the last one listed
+			n = 0;
+			openDir(&cursor, CD_INODE_ENTRY);
+			while ((k = readDir(&cursor, scan, LS_BATCH)) > 0)
+			{
+				for (j = 0; j < k; j++)
+				{
+					if ((total_files + total_dirs > 0 && strcmp(scan[j].name, last) <= 0) ||
+						(n == batch && strcmp(scan[j].name, items[n - 1].name) >= 0))
+						continue; // listed already, or not in this page
+					if (n < batch)
+						n++;
+					for (i = n - 1; i > 0 && strcmp(items[i - 1].name, scan[j].name) > 0; i--)
+						items[i] = items[i - 1]; // make room; the last one drops out if the page is full
+					items[i] = scan[j];
+				}
+			}
+		}
+
+		for (i = 0; i < n; i++)
+		{
+			if (items[i].type == 'F')
+			{ // entry is for a file
+				printf("%s\t", items[i].name);
+				total_files++;
+			}
+			else
+			{ // entry is for a directory; print it in BRED
+				printf("\x1B[31m%s\x1B[0m\t", items[i].name);
+				total_dirs++;
+			}
+		}
+		if (n > 0)
+			strncpy(last, items[n - 1].name, 252);
+
+		if (n < batch || (page > 0 && !morePrompt()))
+			break;
+	}
+
+	printf("\n%d file%c and %d director%s.\n", total_files, (total_files <= 1 ? 0 : 's'), total_dirs, (total_dirs <= 1 ? "y" : "ies"));
+	free(items);
+}
+
+/****************************************************************************/
+/* moves into the directory <dname> within the current directory if 
+/* it exists
+/*
+/****************************************************************************/
+
+void cd(char *dname)
+{
+	char itype;
+	int blocks[3];
+	char dir_block[SFS_BLOCK_SIZE];
+	char name[252];
+
+	int i, pos;
+	int e_inode;
+
+	char found = 0;
+
+	// read inode entry for current directory
+	// in SFS, an inode can point to three blocks at the most
+	itype = _inode_table[CD_INODE_ENTRY].TT[0];
+	blocks[0] = stoi(_inode_table[CD_INODE_ENTRY].XX, 2);
+	blocks[1] = stoi(_inode_table[CD_INODE_ENTRY].YY, 2);
+	blocks[2] = stoi(_inode_table[CD_INODE_ENTRY].ZZ, 2);
+
+	// its a directory; so the following should never happen
+	if (itype == 'F')
+	{
+		printf("Fatal Error! Aborting.\n");
+		exit(1);
+	}
+
+	// now lets try to see if a directory by the name already exists
+	readAhead(CD_INODE_ENTRY, 0, 3);
+	for (i = 0; i < 3; i++)
+	{
+		if (blocks[i] == 0)
+			continue; // 0 means pointing at nothing
+
+		readSFS(blocks[i], dir_block); // lets read a directory block
+
+		pos = 0;
+		while (nextRecord(dir_block, &pos, &e_inode, name))
+		{
+			if (e_inode > 0 && _inode_table[e_inode].TT[0] == 'D')
+			{ // entry is for a directory; can't cd into a file, right?
+				if (strncmp(dname, name, 252) == 0)
+				{			   // and it is the one we are looking for
+					found = 1; // VOILA
+					break;
+				}
+			}
+		}
+		if (found)
+			break; // no need to search more
+	}
+
+	if (found)
+	{
+		CD_INODE_ENTRY = e_inode;						// just keep track of which inode entry in the table corresponds to this directory
+		strncpy(current_working_directory, dname, 252); // can use it in the prompt
+	}
+	else
+	{
+		printf("%.252s: No such directory.\n", dname);
+	}
+}
+
+/****************************************************************************/
+/* creates a new directory called <dname> in the current directory if the 
+/* name is not already taken and there is still space available
+/*
+/****************************************************************************/
+
+void md(char *dname)
+{
+	char itype;
+	int blocks[3];
+	char dir_block[SFS_BLOCK_SIZE];
+	char name[252];
+
+	int i, pos;
+	int e_inode;
+
+	int empty_dblock = -1, room_dblock = -1;
+	int empty_ientry;
+
+	// non-empty name
+	if (strlen(dname) == 0)
+	{
+		printf("Usage: md <directory name>\n");
+		return;
+	}
+
+	// do we have free inodes
+	if (free_inode_entries == 0)
+	{
+		printf("Error: Inode table is full.\n");
+		return;
+	}
+
+	// read inode entry for current directory
+	// in SFS, an inode can point to three blocks at the most
+	itype = _inode_table[CD_INODE_ENTRY].TT[0];
+	blocks[0] = stoi(_inode_table[CD_INODE_ENTRY].XX, 2);
+	blocks[1] = stoi(_inode_table[CD_INODE_ENTRY].YY, 2);
+	blocks[2] = stoi(_inode_table[CD_INODE_ENTRY].ZZ, 2);
+
+	// its a directory; so the following should never happen
+	if (itype == 'F')
+	{
+		printf("Fatal Error! Aborting.\n");
+		exit(1);
+	}
+
+	// now lets try to see if the name already exists
+	readAhead(CD_INODE_ENTRY, 0, 3);
+	for (i = 0; i < 3; i++)
+	{
+		if (blocks[i] == 0)
+		{ // 0 means pointing at nothing
+			if (empty_dblock == -1)
+				empty_dblock = i; // we can later add a block if needed
+			continue;
+		}
+
+		readSFS(blocks[i], dir_block); // lets read a directory block
+
+		if (room_dblock == -1 && recordsEnd(dir_block) + DIR_HEADER + (int)strlen(dname) <= SFS_BLOCK_SIZE)
+			room_dblock = i; // AAHA! lets keep a note of it, just in case we have to create the new directory
+
+		pos = 0;
+		while (nextRecord(dir_block, &pos, &e_inode, name))
+		{
+			if (strncmp(dname, name, 252) == 0)
+			{ // compare with user given name
+				printf("%.252s: Already exists.\n", dname);
+				return;
+			}
+		}
+	}
+	// so directory name is new
+
+	// if no block has room for another record and all three blocks are in use; then no new directory can be made
+	if (room_dblock == -1 && empty_dblock == -1)
+	{
+		printf("Error: Maximum directory entries reached.\n");
+		return;
+	}
+	else
+	{ // otherwise
+		if (room_dblock == -1)
+		{ // Great! no room in the blocks in use but not all three blocks have been used
+			room_dblock = empty_dblock;
+
+			if ((blocks[room_dblock] = getBlock()) == -1)
+			{ // first get a new block using the block bitmap
+				printf("Error: Disk is full.\n");
+				return;
+			}
+
+			writeSFS(blocks[room_dblock], NULL); // write all zeros to the block (there may be junk from the past!)
+			addUsage(CD_INODE_ENTRY, 0, 1, 0);
+
+			switch (room_dblock)
+			{ // update the inode entry of current dir to reflect that we are using a new block
+			case 0:
+				itos(_inode_table[CD_INODE_ENTRY].XX, blocks[room_dblock], 2);
+				break;
+			case 1:
+				itos(_inode_table[CD_INODE_ENTRY].YY, blocks[room_dblock], 2);
+				break;
+			case 2:
+				itos(_inode_table[CD_INODE_ENTRY].ZZ, blocks[room_dblock], 2);
+				break;
+			}
+		}
+
+		// NOTE: all error checkings have already been done at this point!!
+		// time to put everything together
+
+		if ((blocks[room_dblock] = cowBlock(CD_INODE_ENTRY, room_dblock)) == -1)
+		{ // a snapshot holds the directory block and there is no room for a copy
+			printf("Error: Disk is full.\n");
+			return;
+		}
+
+		empty_ientry = getInode(); // get an empty place in the inode table which will store info about blocks for this new directory
+
+		readSFS(blocks[room_dblock], dir_block);	// read block of current directory where info on this new directory will be written
+		addRecord(dir_block, dname, empty_ientry);	// put the name in there, with the index of the inode that will hold info inside this directory
+		writeSFS(blocks[room_dblock], dir_block);	// now write this block back to the disk
+
+		strncpy(_inode_table[empty_ientry].TT, "DI", 2); // create the inode entry...first, its a directory, so DI
+		strncpy(_inode_table[empty_ientry].XX, "00", 2); // directory is just created; so no blocks assigned to it yet
+		strncpy(_inode_table[empty_ientry].YY, "00", 2);
+		strncpy(_inode_table[empty_ientry].ZZ, "00", 2);
+
+		writeSFS(BLOCK_INODE_TABLE, (char *)_inode_table); // phew!! write the inode table back to the disk
+		setParent(empty_ientry, CD_INODE_ENTRY);
+	}
+}
+
+/****************************************************************************/
+/* prints number of free blocks in the disk and free inode entries in the inode table
+/*
+/****************************************************************************/
+
+void stats()
+{
+	int blocks_free = BLB, inodes_free = INB;
+	int i;
+
+	for (i = 0; i < BLB; i++)
+		blocks_free -= (_block_bitmap[i] == '1' || _block_refcount[i] > 0); // snapshots may still hold freed blocks
+	for (i = 0; i < INB; i++)
+		inodes_free -= (_inode_bitmap[i] - 48);
+
+	printf("%d block%c free.\n", blocks_free, (blocks_free <= 1 ? 0 : 's'));
+	printf("%d inode entr%s free.\n", inodes_free, (inodes_free <= 1 ? "y" : "ies"));
+	printf("Striped over %d image file%c, %d block%c per stripe unit.\n", STRIPES, (STRIPES == 1 ? 0 : 's'), STRIPE_UNIT, (STRIPE_UNIT == 1 ? 0 : 's'));
+	printf("Block cache: %d hit%c, %d miss%s, %d block%c read ahead.\n", cache_hits, (cache_hits == 1 ? 0 : 's'), cache_misses, (cache_misses == 1 ? "" : "es"), blocks_read_ahead, (blocks_read_ahead == 1 ? 0 : 's'));
+}
+
+/****************************************************************************/
+/* prints the bytes, blocks and files below entry <name> of the current
+/* directory, or below the current directory if <name> is empty; for a
+/* directory, the directories in it are listed first
+/* every number is read from the usage table, so the size of the tree
+/* does not matter; the table is set up the first time
+/*
+/****************************************************************************/
+
+void du(char *name)
+{
+	_dir_cursor cursor;
+	_dir_item items[8];
+	int inode, i, n;
+
+	if (strlen(name) == 0)
+		inode = CD_INODE_ENTRY;
+	else if ((inode = find_entry(name, 'D')) == -1 && (inode = find_entry(name, 'F')) == -1)
+	{
+		printf("%.252s: No such file or directory.\n", name);
+		return;
+	}
+
+	if (UTB[0] == 0 && SNAP_MOUNTED == -1 && !setupUsage())
+	{
+		printf("Error: Disk is full; no room to keep usage.\n");
+		return;
+	}
+
+	if (_inode_table[inode].TT[0] == 'D')
+	{
+		openDir(&cursor, inode);
+		while ((n = readDir(&cursor, items, 8)) > 0)
+			for (i = 0; i < n; i++)
+				if (items[i].type == 'D')
+					printf("%8d bytes %4d blocks %4d files  %.252s/\n", stoi(_usage_table[items[i].inode].BYTES, 7),
+						   stoi(_usage_table[items[i].inode].BLK, 3), stoi(_usage_table[items[i].inode].FIL, 3), items[i].name);
+	}
+	printf("%8d bytes %4d blocks %4d files  %.252s\n", stoi(_usage_table[inode].BYTES, 7), stoi(_usage_table[inode].BLK, 3),
+		   stoi(_usage_table[inode].FIL, 3), (strlen(name) == 0 ? "." : name));
+}
+/****************************************************************************/
+/* puts the path of the entry <name> in directory <queue>[<i>] in <path>,
+/* starting with <root>
+/*
+/****************************************************************************/
+
+void findPath(char *path, _find_item *queue, int i, char *root)
+{
+	char *names[INODE_MAX + 1];
+	int n = 0;
+
+	for (; i >= 0 && queue[i].parent >= 0; i = queue[i].parent)
+		names[n++] = queue[i].name; // from the bottom up
+
+	strcpy(path, root);
+	while (n > 0 && strlen(path) + strlen(names[n - 1]) + 1 < 4096)
+	{
+		strcat(path, "/");
+		strcat(path, names[--n]);
+	}
+}
+
+/****************************************************************************/
+/* prints the path of every entry below directory <root> whose name matches
+/* the shell pattern <pattern> (every entry if <pattern> is empty)
+/* the tree is walked level by level; each directory waits in a queue, and
+/* the blocks of the next directories in it are read into the cache
+/* together, in block order, before the walk gets to them
+/*
+/****************************************************************************/
+
+void find(char *root, char *pattern)
+{
+	_find_item *queue = (_find_item *)malloc((INODE_MAX + 1) * sizeof(_find_item));
+	_dir_cursor cursor;
+	_dir_item items[LS_BATCH];
+	char seen[INODE_MAX + 1], path[4096], start[4096];
+	int blocks[FIND_PREFETCH];
+	int head = 0, tail = 0, prefetched = 0, found = 0;
+	int i, j, k, n, b, nblocks;
+
+	if ((queue[0].inode = find_path(root)) == -1)
+	{
+		printf("%.252s: No such directory.\n", root);
+		free(queue);
+		return;
+	}
+	snprintf(start, 4096, "%s", (strlen(root) == 0 ? "." : root));
+	if (strlen(start) > 1 && start[strlen(start) - 1] == '/')
+		start[strlen(start) - 1] = 0;
+	if (strcmp(start, "/") == 0)
+		start[0] = 0; // paths below the root directory start with its '/'
+
+	memset(seen, 0, sizeof(seen));
+	seen[queue[0].inode] = 1;
+	queue[0].parent = -1;
+	tail = 1;
+
+	for (head = 0; head < tail; head++)
+	{
+		if (head == prefetched)
+		{ // read the blocks of the directories coming up
+			for (nblocks = 0; prefetched < tail && nblocks + 3 <= FIND_PREFETCH; prefetched++)
+			{
+				char *slots[3] = {_inode_table[queue[prefetched].inode].XX, _inode_table[queue[prefetched].inode].YY, _inode_table[queue[prefetched].inode].ZZ};
+				for (j = 0; j < 3; j++)
+				{
+					if ((b = stoi(slots[j], 2)) <= 0)
+						continue;
+					for (k = nblocks++; k > 0 && blocks[k - 1] > b; k--)
+						blocks[k] = blocks[k - 1]; // in block order, so blocks that follow each other are read together
+					blocks[k] = b;
+				}
+			}
+			prefetchBlocks(blocks, nblocks);
+		}
+
+		openDir(&cursor, queue[head].inode);
+		while ((n = readDir(&cursor, items, LS_BATCH)) > 0)
+		{
+			for (i = 0; i < n; i++)
+			{
+				if (strlen(pattern) == 0 || fnmatch(pattern, items[i].name, 0) == 0)
+				{
+					findPath(path, queue, head, start);
+					printf("%s/%s\n", path, items[i].name);
+					found++;
+				}
+				if (items[i].type == 'D' && !seen[items[i].inode])
+				{ // look in it later
+					seen[items[i].inode] = 1;
+					queue[tail].inode = items[i].inode;
+					queue[tail].parent = head;
+					strncpy(queue[tail].name, items[i].name, 252);
+					tail++;
+				}
+			}
+		}
+	}
+
+	printf("%d entr%s found.\n", found, (found == 1 ? "y" : "ies"));
+	free(queue);
+}
+/****************************************************************************/
+/* returns the number of runs of blocks that follow each other on disk
+/* which the blocks of inode entry <inode> make up; holes do not count
+/*
+/****************************************************************************/
+
+int fileExtents(int inode)
+{
+	char *slots[3] = {_inode_table[inode].XX, _inode_table[inode].YY, _inode_table[inode].ZZ};
+	int i, b, last = -1, extents = 0;
+
+	for (i = 0; i < 3; i++)
+	{
+		if ((b = stoi(slots[i], 2)) <= 0)
+			continue;
+		if (b != last + 1)
+			extents++;
+		last = b;
+	}
+
+	return extents;
+}
+
+/****************************************************************************/
+/* returns the number of runs of free blocks, and puts the length of the
+/* longest one in *largest
+/*
+/****************************************************************************/
+
+int freeRuns(int *largest)
+{
+	int b, len = 0, runs = 0;
+
+	*largest = 0;
+	for (b = BLOCK_INODE_TABLE + 1; b < BLB; b++)
+	{
+		if (_block_bitmap[b] == '0' && _block_refcount[b] == 0)
+		{
+			runs += (len++ == 0);
+			if (len > *largest)
+				*largest = len;
+		}
+		else
+			len = 0;
+	}
+
+	return runs;
+}
+
+/****************************************************************************/
+/* returns the first block of the lowest run of <n> free blocks starting
+/* before block <before>; -1 if there is none
+/*
+/****************************************************************************/
+
+int freeRunAt(int n, int before)
+{
+	int b, len = 0;
+
+	for (b = BLOCK_INODE_TABLE + 1; b < BLB && b - len < before; b++)
+	{
+		if (_block_bitmap[b] == '0' && _block_refcount[b] == 0)
+			len++;
+		else
+			len = 0;
+		if (len == n)
+			return b - n + 1;
+	}
+
+	return -1;
+}
+
+/****************************************************************************/
+/* moves the blocks of inode entry <inode> to the free blocks <start> on,
+/* in order; holes stay holes
+/* the data is copied and the inode table pointing at the copy written in
+/* one batch; the old blocks are left as they are until that is done and
+/* only then given back, so a move cut short leaves the old copy whole
+/* returns 0 if a block could not be taken
+/*
+/****************************************************************************/
+
+int relocate(int inode, int start)
+{
+	char data[SFS_BLOCK_SIZE];
+	char *slots[3] = {_inode_table[inode].XX, _inode_table[inode].YY, _inode_table[inode].ZZ};
+	int old_blocks[3], new_blocks[3], i, j, b = start;
+
+	beginBatch();
+	for (i = 0; i < 3; i++)
+	{
+		new_blocks[i] = 0;
+		if ((old_blocks[i] = stoi(slots[i], 2)) <= 0)
+			continue;
+		new_blocks[i] = b++;
+		if (!takeBlock(new_blocks[i]))
+		{ // give back what was taken so far; nothing points at it yet
+			for (j = 0; j < i; j++)
+				if (new_blocks[j] > 0)
+					returnBlock(new_blocks[j]);
+			endBatch();
+			return 0;
+		}
+	}
+
+	readAhead(inode, 0, 3);
+	for (i = 0; i < 3; i++)
+	{
+		if (new_blocks[i] <= 0)
+			continue;
+		readSFS(old_blocks[i], data);
+		writeSFS(new_blocks[i], data);
+		itos(slots[i], new_blocks[i], 2);
+	}
+	writeSFS(BLOCK_INODE_TABLE, (char *)_inode_table);
+	endBatch();
+
+	beginBatch(); // the bitmap goes out before any old block is punched
+	for (i = 0; i < 3; i++)
+		if (old_blocks[i] > 0)
+			returnBlock(old_blocks[i]);
+	endBatch();
+
+	return 1;
+}
+
+/****************************************************************************/
+/* moves each table the superblock points at (checksums, snapshots, file
+/* sizes, usage, link counts, shares) to the lowest free block below it
+/* returns the number of tables moved
+/*
+/****************************************************************************/
+
+int relocateTables()
+{
+	int *tables[7] = {&CSB, &SNB, &ISB, &UTB[0], &UTB[1], &LCB, &SHB};
+	int offsets[7] = {6, 8, 10, 16, 18, 20, 25}; // where the superblock keeps them
+	char buffer[SFS_BLOCK_SIZE], data[SFS_BLOCK_SIZE];
+	int i, b, old, moved = 0;
+
+	for (i = 0; i < 7; i++)
+	{
+		if ((old = *tables[i]) == 0)
+			continue; // not set up
+		for (b = BLOCK_INODE_TABLE + 1; b < old && !takeBlock(b); b++)
+			;
+		if (b >= old)
+			continue; // nothing free below it
+
+		readSFS(old, data);
+		*tables[i] = b;
+		writeSFS(b, data);
+		readSFS(BLOCK_SUPER, buffer);
+		itos(buffer + offsets[i], b, 2);
+		writeSFS(BLOCK_SUPER, buffer);
+		returnBlock(old);
+		moved++;
+	}
+
+	return moved;
+}
+
+/****************************************************************************/
+/* reports how fragmented files, directories and free space are; unless
+/* <report_only> is set, then moves the tables down, every file and
+/* directory whose blocks are scattered to a run of free blocks, and every
+/* other one to a free run lower down if there is one, so free space
+/* gathers at the end of the disk; nothing is moved onto its own blocks
+/* files and directories are taken in the order of their first block, and
+/* it waits DEFRAG_PAUSE microseconds after each move so a replayed
+/* workload goes on
+/* blocks a snapshot or another file still holds are not moved
+/*
+/****************************************************************************/
+
+void defrag(int report_only)
+{
+	int order[INODE_MAX + 1], first[INODE_MAX + 1];
+	int i, j, k, b, n = 0, nblocks, start, moved = 0, skipped = 0;
+	int fragmented = 0, extents = 0, largest, runs;
+
+	for (i = 0; i < INB && i <= INODE_MAX; i++)
+	{
+		if (_inode_bitmap[i] != '1' || (_inode_table[i].TT[0] != 'F' && _inode_table[i].TT[0] != 'D'))
+			continue;
+		char *slots[3] = {_inode_table[i].XX, _inode_table[i].YY, _inode_table[i].ZZ};
+		for (first[i] = BLOCK_MAX + 1, j = 0; j < 3; j++)
+			if (stoi(slots[j], 2) > 0 && stoi(slots[j], 2) < first[i])
+				first[i] = stoi(slots[j], 2);
+		if (first[i] > BLOCK_MAX)
+			continue; // no blocks at all
+		for (k = n++; k > 0 && first[order[k - 1]] > first[i]; k--)
+			order[k] = order[k - 1];
+		order[k] = i;
+		extents += fileExtents(i);
+		fragmented += (fileExtents(i) > 1);
+	}
+	runs = freeRuns(&largest);
+	printf("%d of %d files and directories fragmented, %d extents in all.\n", fragmented, n, extents);
+	printf("Free space in %d run%c, the longest %d block%c.\n", runs, (runs == 1 ? 0 : 's'), largest, (largest == 1 ? 0 : 's'));
+	if (report_only)
+		return;
+
+	moved = relocateTables();
+	for (k = 0; k < n; k++)
+	{
+		i = order[k];
+		char *slots[3] = {_inode_table[i].XX, _inode_table[i].YY, _inode_table[i].ZZ};
+		for (nblocks = 0, j = 0; j < 3; j++)
+			nblocks += (stoi(slots[j], 2) > 0);
+
+		if ((start = freeRunAt(nblocks, (fileExtents(i) > 1 ? BLB : first[i]))) == -1)
+			continue; // nowhere better to go
+		for (j = 0; j < 3; j++)
+			if ((b = stoi(slots[j], 2)) > 0 && (_block_refcount[b] > 0 || _block_shares[b] > 1))
+				break;
+		if (j < 3)
+		{ // moving it would take up space twice
+			skipped++;
+			continue;
+		}
+
+		if (!relocate(i, start))
+			break;
+		moved++;
+		usleep(DEFRAG_PAUSE);
+	}
+
+	for (extents = 0, fragmented = 0, k = 0; k < n; k++)
+	{
+		extents += fileExtents(order[k]);
+		fragmented += (fileExtents(order[k]) > 1);
+	}
+	runs = freeRuns(&largest);
+	printf("Moved %d, left %d shared with snapshots or other files.\n", moved, skipped);
+	printf("%d of %d files and directories fragmented, %d extents in all.\n", fragmented, n, extents);
+	printf("Free space in %d run%c, the longest %d block%c.\n", runs, (runs == 1 ? 0 : 's'), largest, (largest == 1 ? 0 : 's'));
+}
+int display_file(char *fname)
+{
+	int e_inode = find_entry(fname, 'F'); // this is the inode that has more info about this entry
+
+	if (e_inode == -1)
+		return 0;
+
+	print_file_data(e_inode, 0, file_size(e_inode));
+	printf("\n");
+	return 1;
+}
+int write_file_data(int *blocks, int n, char *buf)
+{
+	beginBatch(); // blocks that follow each other go out with one write
+	for (int i = 0; i < n; i++)
+	{
+		writeSFS(blocks[i], buf + i * SFS_BLOCK_SIZE);
+	}
+	endBatch();
+	return 1;
+}
+
+/****************************************************************************/
+/* reads file content typed by the user into buf until ESC (or end of input)
+/* at most max characters are read
+/* while replaying, the recorded content is used; while tracing, it is kept
+/* to be recorded, with the time spent typing it
+/* returns the number of characters read
+/*
+/****************************************************************************/
+
+int read_input(char *buf, int max)
+{
+	int input_char;
+	int input_len = 0;
+	long start = nowMicros();
+
+	if (replay_input != NULL)
+	{
+		input_len = (replay_input_len - replay_input_pos < max ? replay_input_len - replay_input_pos : max);
+		memcpy(buf, replay_input + replay_input_pos, input_len);
+		replay_input_pos += input_len;
+		return input_len;
+	}
+
+	while (input_len < max)
+	{
+		input_char = getchar();
+		if (input_char == 27 || input_char == EOF)
+			break;
+		buf[input_len++] = input_char;
+	}
+
+	if (trace_file != NULL && trace_input_len + input_len <= FILE_MAX)
+	{
+		memcpy(trace_input + trace_input_len, buf, input_len);
+		trace_input_len += input_len;
+	}
+	trace_typing += nowMicros() - start; // not part of the command's latency
+
+	return input_len;
+}
+
+/****************************************************************************/
+/* returns the inode entry of <fname> in the current directory if it is of
+/* type <type> ('F' or 'D'); -1 if there is no such entry
+/*
+/****************************************************************************/
+
+int find_entry(char *fname, char type)
+{
+	return find_in(CD_INODE_ENTRY, fname, type);
+}
+
+/****************************************************************************/
+/* returns the inode entry of <fname> in directory <dir> if it is of type
+/* <type> ('F' or 'D', or 0 for either); -1 if there is no such entry
+/*
+/****************************************************************************/
+
+int find_in(int dir, char *fname, char type)
+{
+	int blocks[3];
+	char dir_block[SFS_BLOCK_SIZE];
+	char name[252];
+	int i, pos, e_inode;
+
+	blocks[0] = stoi(_inode_table[dir].XX, 2);
+	blocks[1] = stoi(_inode_table[dir].YY, 2);
+	blocks[2] = stoi(_inode_table[dir].ZZ, 2);
+
+	readAhead(dir, 0, 3);
+	for (i = 0; i < 3; i++)
+	{
+		if (blocks[i] == 0)
+			continue; // 0 means pointing at nothing
+
+		readSFS(blocks[i], dir_block);
+		pos = 0;
+		while (nextRecord(dir_block, &pos, &e_inode, name))
+		{
+			if (e_inode > 0 && (type == 0 ? _inode_table[e_inode].TT[0] == 'F' || _inode_table[e_inode].TT[0] == 'D' : _inode_table[e_inode].TT[0] == type) &&
+				strncmp(name, fname, 252) == 0)
+				return e_inode;
+		}
+	}
+
+	return -1;
+}
+
+/****************************************************************************/
+/* returns the inode entry of the directory at <path>; -1 if there is none
+/* a path starting with '/' starts at the root directory, any other path
+/* (the empty one included) at the current directory
+/*
+/****************************************************************************/
+
+int find_path(char *path)
+{
+	char name[252];
+	int inode = (path[0] == '/' ? 0 : CD_INODE_ENTRY);
+	int len;
+
+	while (*path != 0 && inode != -1)
+	{
+		while (*path == '/')
+			path++;
+		for (len = 0; path[len] != 0 && path[len] != '/'; len++)
+			;
+		if (len == 0)
+			break;
+		if (len > 251)
+			return -1;
+		memcpy(name, path, len);
+		name[len] = 0;
+		path += len;
+		if (strcmp(name, ".") != 0)
+			inode = find_in(inode, name, 'D');
+	}
+
+	return inode;
+}
+
+/****************************************************************************/
+/* copies the whole file with inode entry <inode> into buf, which must have
+/* room for FILE_MAX bytes
+/* returns the size of the file
+/*
+/****************************************************************************/
+
+int get_file_data(int inode, char *buf)
+{
+	char *slots[3] = {_inode_table[inode].XX, _inode_table[inode].YY, _inode_table[inode].ZZ};
+	int size = file_size(inode);
+	int i;
+
+	if (size > 0)
+		readAhead(inode, 0, (size - 1) / SFS_BLOCK_SIZE + 1);
+	for (i = 0; i < 3 && i * SFS_BLOCK_SIZE < size; i++)
+	{
+		if (stoi(slots[i], 2) <= 0 || !readSFS(stoi(slots[i], 2), buf + i * SFS_BLOCK_SIZE))
+			memset(buf + i * SFS_BLOCK_SIZE, 0, SFS_BLOCK_SIZE);
 	}
-	return 0;
+
+	return size;
 }
-int write_file_data(int *blocks, int n, char *buf)
+
+/****************************************************************************/
+/* returns the exact size in bytes of the file with inode entry <inode>
+/* files written before sizes were kept are measured from their data,
+/* which was always padded with null characters
+/*
+/****************************************************************************/
+
+int file_size(int inode)
 {
-	for (int i = 0; i < n; i++)
+	char buf[SFS_BLOCK_SIZE];
+	char *slots[3] = {_inode_table[inode].XX, _inode_table[inode].YY, _inode_table[inode].ZZ};
+	int size = 0, n;
+
+	if (ISB != 0)
+		return stoi(_inode_sizes + inode * 8, 8);
+
+	for (int i = 0; i < 3; i++)
+	{
+		if (stoi(slots[i], 2) <= 0 || !readSFS(stoi(slots[i], 2), buf))
+			break;
+		size += (n = strnlen(buf, SFS_BLOCK_SIZE));
+		if (n < SFS_BLOCK_SIZE)
+			break;
+	}
+
+	return size;
+}
+
+/****************************************************************************/
+/* records <size> as the exact size of the file with inode entry <inode>
+/* sets up the file size table on first use
+/* returns 0 if there is no room for the table
+/*
+/****************************************************************************/
+
+int set_file_size(int inode, int size)
+{
+	char buffer[SFS_BLOCK_SIZE];
+	int b, i;
+
+	if (ISB == 0)
+	{ // keep the sizes of all existing files before switching over
+		if ((b = getBlock()) == -1)
+			return 0;
+		for (i = 0; i <= INODE_MAX; i++)
+			itos(_inode_sizes + i * 8, (_inode_bitmap[i] == '1' && _inode_table[i].TT[0] == 'F') ? file_size(i) : 0, 8);
+		writeSFS(b, _inode_sizes);
+		readSFS(BLOCK_SUPER, buffer);
+		itos(buffer + 10, b, 2);
+		writeSFS(BLOCK_SUPER, buffer);
+		ISB = b;
+	}
+
+	itos(_inode_sizes + inode * 8, size, 8);
+	writeSFS(ISB, _inode_sizes);
+
+	return 1;
+}
+
+/****************************************************************************/
+/* prints <len> bytes of the file with inode entry <inode> from <offset> on
+/* only the blocks holding those bytes are read
+/*
+/****************************************************************************/
+
+void print_file_data(int inode, int offset, int len)
+{
+	char buf[SFS_BLOCK_SIZE];
+	char *slots[3] = {_inode_table[inode].XX, _inode_table[inode].YY, _inode_table[inode].ZZ};
+	int i, from, to;
+
+	if (len > 0)
+		readAhead(inode, offset / SFS_BLOCK_SIZE, (offset + len - 1) / SFS_BLOCK_SIZE - offset / SFS_BLOCK_SIZE + 1);
+	for (i = offset / SFS_BLOCK_SIZE; i < 3 && i * SFS_BLOCK_SIZE < offset + len; i++)
+	{
+		if (stoi(slots[i], 2) <= 0 || !readSFS(stoi(slots[i], 2), buf))
+			memset(buf, 0, SFS_BLOCK_SIZE);
+
+		from = (offset > i * SFS_BLOCK_SIZE ? offset - i * SFS_BLOCK_SIZE : 0);
+		to = (offset + len < (i + 1) * SFS_BLOCK_SIZE ? offset + len - i * SFS_BLOCK_SIZE : SFS_BLOCK_SIZE);
+		fwrite(buf + from, 1, to - from, stdout);
+	}
+}
+
+/****************************************************************************/
+/* prints <len> bytes of file <fname> starting at byte <offset>
+/*
+/****************************************************************************/
+
+int read_file(char *fname, int offset, int len)
+{
+	int inode = find_entry(fname, 'F');
+	int size;
+
+	if (inode == -1)
+	{
+		printf("%.252s: No such file.\n", fname);
+		return 0;
+	}
+
+	size = file_size(inode);
+	if (offset < size)
+		print_file_data(inode, offset, (len < size - offset ? len : size - offset));
+	printf("\n");
+
+	return 1;
+}
+
+/****************************************************************************/
+/* writes what the user types over file <fname> starting at byte <offset>,
+/* or at the end of the file if <append> is set; the file grows as needed
+/* only blocks touched by the new bytes are read and written
+/* blocks skipped over past the end of the file are left as holes
+/*
+/****************************************************************************/
+
+int write_file(char *fname, int offset, int append)
+{
+	char input_buf[FILE_MAX], buf[SFS_BLOCK_SIZE];
+	int inode = find_entry(fname, 'F');
+	int size, len, end, b, i, from, to;
+	int inode_table_dirty = 0, new_blocks = 0;
+
+	if (inode == -1)
+	{
+		printf("%.252s: No such file.\n", fname);
+		return 0;
+	}
+
+	char *slots[3] = {_inode_table[inode].XX, _inode_table[inode].YY, _inode_table[inode].ZZ};
+
+	size = file_size(inode);
+	if (append)
+		offset = size;
+	if (offset >= FILE_MAX)
+	{
+		printf("Error: files can not be larger than %d bytes.\n", FILE_MAX);
+		return 0;
+	}
+
+	printf("give input\n");
+	len = read_input(input_buf, FILE_MAX - offset);
+	end = offset + len;
+
+	for (i = 0; i < 3 && i * SFS_BLOCK_SIZE < end; i++)
 	{
-		writeSFS(blocks[i], buf + i * 1024);
+		b = stoi(slots[i], 2);
+		if (b <= 0 && i < offset / SFS_BLOCK_SIZE)
+			continue; // gap before offset; stays a hole, which reads as zeros
+		if (b <= 0)
+		{ // a hole or past the old end of file; starts out as all zeros
+			if ((b = getBlock()) == -1)
+			{
+				printf("Out of space\n");
+				end = (i * SFS_BLOCK_SIZE > offset ? i * SFS_BLOCK_SIZE : offset);
+				break;
+			}
+			memset(buf, 0, SFS_BLOCK_SIZE);
+			itos(slots[i], b, 2);
+			inode_table_dirty = 1;
+			new_blocks++;
+		}
+		else if (i < offset / SFS_BLOCK_SIZE)
+			continue; // untouched
+		else
+		{
+			if ((b = cowBlock(inode, i)) == -1)
+			{ // a snapshot holds the old contents
+				printf("Out of space\n");
+				end = (i * SFS_BLOCK_SIZE > offset ? i * SFS_BLOCK_SIZE : offset);
+				break;
+			}
+			from = (offset > i * SFS_BLOCK_SIZE ? offset - i * SFS_BLOCK_SIZE : 0);
+			to = (end < (i + 1) * SFS_BLOCK_SIZE ? end - i * SFS_BLOCK_SIZE : SFS_BLOCK_SIZE);
+			if (from > 0 || to < SFS_BLOCK_SIZE)
+				readSFS(b, buf); // only part of the block changes
+		}
+
+		from = (offset > i * SFS_BLOCK_SIZE ? offset - i * SFS_BLOCK_SIZE : 0);
+		to = (end < (i + 1) * SFS_BLOCK_SIZE ? end - i * SFS_BLOCK_SIZE : SFS_BLOCK_SIZE);
+		memcpy(buf + from, input_buf + i * SFS_BLOCK_SIZE + from - offset, to - from);
+		writeSFS(b, buf);
 	}
+
+	if (inode_table_dirty)
+		writeSFS(BLOCK_INODE_TABLE, (char *)_inode_table);
+	if (end > size)
+		set_file_size(inode, end);
+	addUsage(inode, (end > size ? end - size : 0), new_blocks, 0);
+
 	return 1;
 }
 
-int creat_file(char *fname)
+int creat_file(char *fname, char *data, int len)
 {
 	if (free_inode_entries == 0)
 	{
@@ -669,8 +3919,8 @@ int creat_file(char *fname)
 	}
 	char itype;
 	int blocks[3];
-	int dir_dnode = -1, block_number = -1;
-	_directory_entry _directory_entries[4];
+	int block_number = -1, e_inode, pos;
+	char dir_block[SFS_BLOCK_SIZE], name[252];
 	itype = _inode_table[CD_INODE_ENTRY].TT[0];
 	blocks[0] = stoi(_inode_table[CD_INODE_ENTRY].XX, 2);
 	blocks[1] = stoi(_inode_table[CD_INODE_ENTRY].YY, 2);
@@ -682,41 +3932,33 @@ int creat_file(char *fname)
 		printf("Fatal Error! Aborting.\n");
 		exit(1);
 	}
+	readAhead(CD_INODE_ENTRY, 0, 3);
 	for (int i = 0; i < 3; i++)
 	{
 		if (blocks[i] != 0)
 		{
-			readSFS(blocks[i], (char *)_directory_entries);
-			for (int j = 0; j < 4; j++)
+			readSFS(blocks[i], dir_block);
+			if (block_number == -1 && recordsEnd(dir_block) + DIR_HEADER + (int)strlen(fname) <= SFS_BLOCK_SIZE)
 			{
-				if (_directory_entries[j].F == '0')
-				{
-					block_number = i;
-					dir_dnode = j;
-				}
-				else
-				{
-					if (strcmp(_directory_entries[j].fname, fname) == 0)
-					{
-						printf("File already exist\n");
-						return 0;
-					}
-				}
+				block_number = i;
 			}
-		}
-		else
-		{
-			if (dir_dnode == -1)
+			pos = 0;
+			while (nextRecord(dir_block, &pos, &e_inode, name))
 			{
-				block_number = i;
+				if (strcmp(name, fname) == 0)
+				{
+					printf("File already exist\n");
+					return 0;
+				}
 			}
 		}
 	}
-	if (block_number == -1)
+	if (block_number == -1 && blocks[0] && blocks[1] && blocks[2])
 	{
 		printf("Maximum limit reached for directory\n");
+		return 0;
 	}
-	if (dir_dnode == -1)
+	if (block_number == -1)
 	{
 		int bn = getBlock();
 		if (bn == -1)
@@ -724,54 +3966,58 @@ int creat_file(char *fname)
 			printf("ERROR: datablock limit reached\n");
 			return 0;
 		}
+		writeSFS(bn, NULL); // new directory block; clear junk from the past
+		addUsage(CD_INODE_ENTRY, 0, 1, 0);
 		char temp[2];
 		itos(temp, bn, 2);
 		if (!blocks[0])
 		{
 			strncpy(_inode_table[CD_INODE_ENTRY].XX, temp, 2);
+			block_number = 0;
 		}
 		else if (!blocks[1])
 		{
 			strncpy(_inode_table[CD_INODE_ENTRY].YY, temp, 2);
+			block_number = 1;
 		}
 		else if (!blocks[2])
 		{
 			strncpy(_inode_table[CD_INODE_ENTRY].ZZ, temp, 2);
+			block_number = 2;
 		}
-		block_number = bn;
-		dir_dnode = 0;
+		blocks[block_number] = bn;
+	}
+	if ((blocks[block_number] = cowBlock(CD_INODE_ENTRY, block_number)) == -1)
+	{
+		printf("ERROR: datablock limit reached\n");
+		return 0;
 	}
-	readSFS(blocks[block_number], (char *)_directory_entries);
-	_directory_entries[dir_dnode].F = '1';
-	strncpy(_directory_entries[dir_dnode].fname, fname, 253);
-	char inode_number[3];
+	readSFS(blocks[block_number], dir_block);
 	int inn = getInode();
 	if (inn == -1)
 	{
 		printf("ERROR: Inode limit reached\n");
 		return 0;
 	}
-	itos(inode_number, inn, 3);
-	strncpy(_directory_entries[dir_dnode].MMM, inode_number, 3);
-	writeSFS(block_number, (char *)_directory_entries);
-	char input_buf[3072];
-	int input_char;
+	addRecord(dir_block, fname, inn);
+	writeSFS(blocks[block_number], dir_block);
+	char input_buf[FILE_MAX];
 	int input_len = 0, written_block = 0;
-	memset(input_buf, 0, 3072);
-	printf("give input\n");
-	while (input_len < 3071)
+	memset(input_buf, 0, FILE_MAX);
+	if (data == NULL)
+	{ // content comes from the user
+		printf("give input\n");
+		input_len = read_input(input_buf, FILE_MAX);
+	}
+	else
 	{
-		input_char = getchar();
-		if (input_char == 27)
-		{
-			break;
-		}
-		input_buf[input_len++] = input_char;
+		input_len = (len < FILE_MAX ? len : FILE_MAX);
+		memcpy(input_buf, data, input_len);
 	}
 	blocks[0] = 0;
 	blocks[1] = 0;
 	blocks[2] = 0;
-	if (input_len < 1024)
+	if (input_len < SFS_BLOCK_SIZE)
 	{
 		blocks[0] = getBlock();
 		if (blocks[0] == -1)
@@ -782,7 +4028,7 @@ int creat_file(char *fname)
 		write_file_data(blocks, 1, input_buf);
 		written_block = 1;
 	}
-	else if (input_len > 1023 && input_len < 2048)
+	else if (input_len < 2 * SFS_BLOCK_SIZE)
 	{
 		blocks[0] = getBlock();
 		blocks[1] = getBlock();
@@ -794,7 +4040,7 @@ int creat_file(char *fname)
 		write_file_data(blocks, 2, input_buf);
 		written_block = 2;
 	}
-	else if (input_len > 2047)
+	else
 	{
 		blocks[0] = getBlock();
 		blocks[1] = getBlock();
@@ -816,31 +4062,294 @@ int creat_file(char *fname)
 	itos(temp, blocks[2], 2);
 	strncpy(_inode_table[inn].ZZ, temp, 2);
 	writeSFS(3, (char *)_inode_table);
+	set_file_size(inn, input_len);
+	setParent(inn, CD_INODE_ENTRY);
+	addUsage(inn, input_len, written_block, 1);
+	return 1;
+}
+/****************************************************************************/
+/* adds up the inode entries and blocks needed to import host directory
+/* <hostpath> as a directory called <name>
+/* returns 0 if something in the tree can not be imported
+/*
+/****************************************************************************/
+
+int tree_needs(char *hostpath, char *name, int *inodes, int *blocks)
+{
+	DIR *dir;
+	struct dirent *ent;
+	struct stat st;
+	char path[4096];
+	int dir_blocks = 0, used = 0, record;
+
+	if (strlen(name) == 0 || strlen(name) > 251)
+	{
+		printf("%s: Name can not be used in SFS.\n", hostpath);
+		return 0;
+	}
+	if ((dir = opendir(hostpath)) == NULL)
+	{
+		printf("%s: %s\n", hostpath, strerror(errno));
+		return 0;
+	}
+
+	(*inodes)++;
+	while ((ent = readdir(dir)) != NULL)
+	{
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+		snprintf(path, 4096, "%s/%s", hostpath, ent->d_name);
+		if (stat(path, &st) != 0 || (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)))
+			continue; // skipped when importing too
+
+		// records are packed into the directory blocks in the order they are added
+		record = DIR_HEADER + strlen(ent->d_name);
+		if (dir_blocks == 0 || used + record > SFS_BLOCK_SIZE)
+		{
+			dir_blocks++;
+			used = 0;
+		}
+		used += record;
+
+		if (S_ISDIR(st.st_mode))
+		{
+			if (!tree_needs(path, ent->d_name, inodes, blocks))
+			{
+				closedir(dir);
+				return 0;
+			}
+		}
+		else if (st.st_size > FILE_MAX || strlen(ent->d_name) > 251)
+		{
+			if (st.st_size > FILE_MAX)
+				printf("%s: Files can not be larger than %d bytes.\n", path, FILE_MAX);
+			else
+				printf("%s: Name can not be used in SFS.\n", path);
+			closedir(dir);
+			return 0;
+		}
+		else
+		{
+			(*inodes)++;
+			*blocks += (st.st_size == 0 ? 1 : (st.st_size + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE); // even an empty file gets a block
+		}
+	}
+	closedir(dir);
+
+	if (dir_blocks > 3)
+	{
+		printf("%s: Too many entries for an SFS directory.\n", hostpath);
+		return 0;
+	}
+	*blocks += dir_blocks;
+
 	return 1;
 }
-int get_files_name(int inode_number, char names[12][252])
+
+/****************************************************************************/
+/* makes directory <name> in the current directory and copies the files and
+/* directories of host directory <hostpath> into it
+/* returns 0 on error
+/*
+/****************************************************************************/
+
+int import_dir(char *hostpath, char *name, int *files, int *dirs, int *bytes)
+{
+	DIR *dir;
+	struct dirent *ent;
+	struct stat st;
+	FILE *hf;
+	char path[4096];
+	static char data[FILE_MAX]; // not needed across the recursion; kept off the stack
+	char prev_dir_name[252];
+	int prev_dir = CD_INODE_ENTRY;
+	int inode, len, ok = 1;
+
+	md(name);
+	if ((inode = find_entry(name, 'D')) == -1 || (dir = opendir(hostpath)) == NULL)
+		return 0; // md has said why
+	(*dirs)++;
+
+	strncpy(prev_dir_name, current_working_directory, 252);
+	CD_INODE_ENTRY = inode;
+	strncpy(current_working_directory, name, 252);
+
+	while (ok && (ent = readdir(dir)) != NULL)
+	{
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+		snprintf(path, 4096, "%s/%s", hostpath, ent->d_name);
+		if (stat(path, &st) != 0)
+			continue;
+
+		if (S_ISDIR(st.st_mode))
+			ok = import_dir(path, ent->d_name, files, dirs, bytes);
+		else if (S_ISREG(st.st_mode))
+		{
+			if ((hf = fopen(path, "rb")) == NULL)
+			{
+				printf("%s: %s\n", path, strerror(errno));
+				ok = 0;
+				break;
+			}
+			len = fread(data, 1, FILE_MAX, hf);
+			fclose(hf);
+			if ((ok = creat_file(ent->d_name, data, len)))
+			{
+				(*files)++;
+				*bytes += len;
+			}
+		}
+		else
+			printf("%s: Not a file or directory; skipped.\n", path);
+	}
+	closedir(dir);
+
+	CD_INODE_ENTRY = prev_dir;
+	strncpy(current_working_directory, prev_dir_name, 252);
+
+	return ok;
+}
+
+/****************************************************************************/
+/* copies host directory <hostdir> with everything in it into the current
+/* directory, under the last part of its path
+/* space for the whole tree is checked before anything is written, and it
+/* is written in one batch so each metadata block is written only once
+/*
+/****************************************************************************/
+
+int import_tree(char *hostdir)
+{
+	char name[4096];
+	char *base;
+	int inodes = 0, blocks = 0;
+	int files = 0, dirs = 0, bytes = 0, ok;
+
+	strncpy(name, hostdir, 4095);
+	name[4095] = '\0';
+	while (strlen(name) > 1 && name[strlen(name) - 1] == '/')
+		name[strlen(name) - 1] = '\0'; // "dir/" is "dir"
+	base = (strrchr(name, '/') ? strrchr(name, '/') + 1 : name);
+
+	if (strlen(hostdir) == 0)
+	{
+		printf("Usage: import-tree <host directory>\n");
+		return 0;
+	}
+	if (find_entry(base, 'D') != -1 || find_entry(base, 'F') != -1)
+	{
+		printf("%.252s: Already exists.\n", base);
+		return 0;
+	}
+	if (!tree_needs(name, base, &inodes, &blocks))
+		return 0;
+
+	blocks += (ISB == 0) + 1; // the file size table and one more block for the current directory
+	if (inodes > free_inode_entries || blocks > free_disk_blocks)
+	{
+		printf("Error: %s needs %d inode entries and %d blocks; %d and %d are free.\n", name, inodes, blocks, free_inode_entries, free_disk_blocks);
+		return 0;
+	}
+
+	beginBatch();
+	ok = import_dir(name, base, &files, &dirs, &bytes);
+	endBatch();
+
+	printf("%d file%c and %d director%s imported, %d bytes.\n", files, (files == 1 ? 0 : 's'), dirs, (dirs == 1 ? "y" : "ies"), bytes);
+	return ok;
+}
+
+/****************************************************************************/
+/* copies the files and directories of directory <inode> into host
+/* directory <hostpath>, which must exist
+/* returns 0 on error
+/*
+/****************************************************************************/
+
+int export_dir(int inode, char *hostpath, int *files, int *dirs, int *bytes)
 {
-	int blk[3], index = 0;
-	_directory_entry store_file_name[4];
-	blk[0] = stoi(_inode_table[inode_number].XX, 2);
-	blk[1] = stoi(_inode_table[inode_number].YY, 2);
-	blk[2] = stoi(_inode_table[inode_number].ZZ, 2);
-	for (int kk = 0; kk < 3; kk++)
+	_dir_cursor cursor;
+	_dir_item items[8];
+	FILE *hf;
+	char path[4096];
+	static char data[FILE_MAX]; // not needed across the recursion; kept off the stack
+	int i, n, len;
+
+	openDir(&cursor, inode);
+	while ((n = readDir(&cursor, items, 8)) > 0)
 	{
-		if (blk[kk] != 0)
+		for (i = 0; i < n; i++)
 		{
-			readSFS(blk[kk], (char *)store_file_name);
-			for (int jj = 0; jj < 4; jj++)
+			if (strchr(items[i].name, '/') || !strcmp(items[i].name, ".") || !strcmp(items[i].name, ".."))
+			{
+				printf("%.252s: Name can not be used on the host; skipped.\n", items[i].name);
+				continue;
+			}
+			snprintf(path, 4096, "%s/%s", hostpath, items[i].name);
+
+			if (items[i].type == 'D')
+			{
+				if (mkdir(path, 0755) != 0 && errno != EEXIST)
+				{
+					printf("%s: %s\n", path, strerror(errno));
+					return 0;
+				}
+				(*dirs)++;
+				if (!export_dir(items[i].inode, path, files, dirs, bytes))
+					return 0;
+			}
+			else
 			{
-				if (store_file_name[jj].F == '1')
+				len = get_file_data(items[i].inode, data);
+				if ((hf = fopen(path, "wb")) == NULL || fwrite(data, 1, len, hf) != (size_t)len)
 				{
-					strncpy(names[index++], store_file_name[jj].fname, 252);
+					printf("%s: %s\n", path, strerror(errno));
+					if (hf != NULL)
+						fclose(hf);
+					return 0;
 				}
+				fclose(hf);
+				(*files)++;
+				*bytes += len;
 			}
 		}
 	}
+
 	return 1;
 }
+
+/****************************************************************************/
+/* copies directory <dname> of the current directory, with everything in
+/* it, into host directory <hostdir>; the host directory is made if needed
+/*
+/****************************************************************************/
+
+int export_tree(char *dname, char *hostdir)
+{
+	int inode = find_entry(dname, 'D');
+	int files = 0, dirs = 0, bytes = 0, ok;
+
+	if (strlen(dname) == 0 || strlen(hostdir) == 0)
+	{
+		printf("Usage: export-tree <directory> <host directory>\n");
+		return 0;
+	}
+	if (inode == -1)
+	{
+		printf("%.252s: No such directory.\n", dname);
+		return 0;
+	}
+	if (mkdir(hostdir, 0755) != 0 && errno != EEXIST)
+	{
+		printf("%s: %s\n", hostdir, strerror(errno));
+		return 0;
+	}
+
+	ok = export_dir(inode, hostdir, &files, &dirs, &bytes);
+	printf("%d file%c and %d director%s exported, %d bytes.\n", files, (files == 1 ? 0 : 's'), dirs, (dirs == 1 ? "y" : "ies"), bytes);
+	return ok;
+}
 int remove_file(int inode)
 {
 	int blocks[3];
@@ -849,9 +4358,22 @@ int remove_file(int inode)
 	blocks[0] = stoi(_inode_table[inode].XX, 2);
 	blocks[1] = stoi(_inode_table[inode].YY, 2);
 	blocks[2] = stoi(_inode_table[inode].ZZ, 2);
+	if (linkCount(inode) > 1)
+	{ // other names still point at it
+		setLinkCount(inode, linkCount(inode) - 1);
+		return 1;
+	}
+	beginBatch(); // the cleared inode goes out before any freed block is punched
+	dropUsage(inode);
 	for (int i = 0; i < 3; i++)
 	{
-		if (blocks[i] != 0)
+		if (blocks[i] > 0 && _block_shares[blocks[i]] > 1)
+		{
+			setShares(blocks[i], _block_shares[blocks[i]] - 1); // a reflinked copy still uses it
+			if (shareOwner(blocks[i], -1) == inode)
+				addUsage(shareOwner(blocks[i], inode), 0, 1, 0); // and counts it from now on
+		}
+		else if (blocks[i] != 0)
 		{
 			returnBlock(blocks[i]);
 		}
@@ -861,6 +4383,7 @@ int remove_file(int inode)
 	strncpy(_inode_table[inode].ZZ, "00", 2);
 	writeSFS(3, (char *)_inode_table);
 	returnInode(inode);
+	endBatch();
 	return 1;
 }
 void check_dir_block()
@@ -876,13 +4399,18 @@ void check_dir_block()
 		printf("Fatal Error! Aborting.\n");
 		exit(1);
 	}
-	_directory_entry de[4];
+	char de[SFS_BLOCK_SIZE];
 	for (int i = 0; i < 3; i++)
 	{
-		readSFS(blocks[i], (char *)de);
-		if (de[0].F == '0' && de[1].F == '0' && de[2].F == '0' && de[3].F == '0')
+		if (blocks[i] == 0)
+		{
+			continue;
+		}
+		readSFS(blocks[i], de);
+		if (recordsEnd(de) == 0)
 		{
 			returnBlock(blocks[i]);
+			addUsage(CD_INODE_ENTRY, 0, -1, 0);
 			if (i == 0)
 			{
 				strncpy(_inode_table[CD_INODE_ENTRY].XX, "00", 2);
@@ -901,23 +4429,29 @@ void check_dir_block()
 }
 int remove(char *fname)
 {
-	int blocks[3], inode_number, is_file;
-	char inode_number_string[3], itype;
-	_directory_entry _directory_entries[4];
-	itype = _inode_table[CD_INODE_ENTRY].TT[0];
+	int blocks[3], inode_number, is_file, pos, prev_pos;
+	char dir_block[SFS_BLOCK_SIZE], name[252];
 	blocks[0] = stoi(_inode_table[CD_INODE_ENTRY].XX, 2);
 	blocks[1] = stoi(_inode_table[CD_INODE_ENTRY].YY, 2);
 	blocks[2] = stoi(_inode_table[CD_INODE_ENTRY].ZZ, 2);
+	readAhead(CD_INODE_ENTRY, 0, 3);
 	for (int i = 0; i < 3; i++)
 	{
 		if (blocks[i] != 0)
 		{
-			readSFS(blocks[i], (char *)_directory_entries);
-			for (int j = 0; j < 4; j++)
+			readSFS(blocks[i], dir_block);
+			pos = 0;
+			prev_pos = 0;
+			while (nextRecord(dir_block, &pos, &inode_number, name))
 			{
-				if (_directory_entries[j].F == '1' && !strncmp(_directory_entries[j].fname, fname, 252))
+				if (inode_number > 0 && !strncmp(name, fname, 252))
 				{
-					inode_number = stoi(_directory_entries[j].MMM, 3);
+					// the block losing the record is copied first if a snapshot holds it, so a full disk changes nothing
+					if ((blocks[i] = cowBlock(CD_INODE_ENTRY, i)) == -1)
+					{
+						printf("Error: Disk is full.\n");
+						return 1;
+					}
 					is_file = (_inode_table[inode_number].TT[0] == 'F');
 					if (is_file)
 					{
@@ -929,30 +4463,388 @@ int remove(char *fname)
 						char prev_dir_name[252];
 						strncpy(prev_dir_name, current_working_directory, 252);
 						cd(fname);
-						char list[12][252];
-						int index = get_files_name(inode_number, list);
-						for (int kk = 0; kk < index; kk++)
+						_dir_cursor cursor;
+						_dir_item list[LS_BATCH];
+						char first_name[252] = "";
+						int index;
+						// the directory shrinks as its entries go, so start over after every batch
+						openDir(&cursor, inode_number);
+						while ((index = readDir(&cursor, list, LS_BATCH)) > 0 && strncmp(first_name, list[0].name, 252) != 0)
 						{
-							remove(list[kk]);
+							strncpy(first_name, list[0].name, 252); // still there next time means nothing could be removed
+							for (int kk = 0; kk < index; kk++)
+							{
+								remove(list[kk].name);
+							}
+							openDir(&cursor, inode_number);
 						}
-						returnInode(inode_number);
 						CD_INODE_ENTRY = store_prev_dir;
 						strncpy(current_working_directory, prev_dir_name, 252);
+						openDir(&cursor, inode_number);
+						if (readDir(&cursor, list, 1) > 0)
+						{ // some entry could not be removed; the directory stays
+							printf("%.252s: Directory not empty.\n", fname);
+							return 1;
+						}
+						dropUsage(inode_number);
+						returnInode(inode_number);
 					}
-					_directory_entries[j].F = '0';
-					writeSFS(blocks[i], (char *)_directory_entries);
+					removeRecord(dir_block, prev_pos);
+					writeSFS(blocks[i], dir_block);
 					check_dir_block();
+					if (is_file && _inode_bitmap[inode_number] == '1' && stoi(_usage_table[inode_number].PPP, 3) == CD_INODE_ENTRY && !dirLinks(CD_INODE_ENTRY, inode_number))
+					{ // the file has other names; its usage goes to one of their directories
+						int parent = otherParent(inode_number);
+						if (!dirLinks(parent, inode_number))
+							parent = findParent(0, inode_number); // that name is gone too
+						if (parent != -1)
+							moveUsage(inode_number, parent);
+					}
 					return 1;
 				}
+				prev_pos = pos;
+			}
+		}
+	}
+	return 0;
+}
+/****************************************************************************/
+/* returns 1 if inode entry <target> is directory <dir> or anywhere below it
+/*
+/****************************************************************************/
+
+int in_subtree(int dir, int target)
+{
+	_dir_cursor cursor;
+	_dir_item items[8];
+	int i, n;
+
+	if (dir == target)
+		return 1;
+
+	openDir(&cursor, dir);
+	while ((n = readDir(&cursor, items, 8)) > 0)
+		for (i = 0; i < n; i++)
+			if (items[i].type == 'D' && in_subtree(items[i].inode, target))
+				return 1;
+
+	return 0;
+}
+
+/****************************************************************************/
+/* puts a record for <name> with inode entry <e_inode> in directory <dir>,
+/* in the first block with room, or in a new block
+/* returns 0 if the directory is full or the disk is
+/*
+/****************************************************************************/
+
+int link_entry(int dir, char *name, int e_inode)
+{
+	char *slots[3] = {_inode_table[dir].XX, _inode_table[dir].YY, _inode_table[dir].ZZ};
+	char dir_block[SFS_BLOCK_SIZE];
+	int i, b;
+
+	readAhead(dir, 0, 3);
+	for (i = 0; i < 3; i++)
+	{
+		if ((b = stoi(slots[i], 2)) <= 0)
+			continue;
+		readSFS(b, dir_block);
+		if (recordsEnd(dir_block) + DIR_HEADER + (int)strlen(name) <= SFS_BLOCK_SIZE)
+			break; // room here
+	}
+
+	if (i == 3)
+	{ // no room; start a new block
+		for (i = 0; i < 3 && stoi(slots[i], 2) > 0; i++)
+			;
+		if (i == 3 || (b = getBlock()) == -1)
+			return 0;
+		writeSFS(b, NULL); // clear junk from the past
+		itos(slots[i], b, 2);
+		writeSFS(BLOCK_INODE_TABLE, (char *)_inode_table);
+		addUsage(dir, 0, 1, 0);
+	}
+
+	if ((b = cowBlock(dir, i)) == -1)
+		return 0;
+	readSFS(b, dir_block);
+	addRecord(dir_block, name, e_inode);
+	writeSFS(b, dir_block);
+
+	return 1;
+}
+
+/****************************************************************************/
+/* takes the record for <name> with inode entry <e_inode> out of directory
+/* <dir>; the entry itself is left alone
+/* returns 0 if there is no such record
+/*
+/****************************************************************************/
+
+int unlink_entry(int dir, char *name, int e_inode)
+{
+	char *slots[3] = {_inode_table[dir].XX, _inode_table[dir].YY, _inode_table[dir].ZZ};
+	char dir_block[SFS_BLOCK_SIZE], rname[252];
+	int i, b, pos, prev_pos, r_inode;
+
+	for (i = 0; i < 3; i++)
+	{
+		if ((b = stoi(slots[i], 2)) <= 0)
+			continue;
+		readSFS(b, dir_block);
+		pos = prev_pos = 0;
+		while (nextRecord(dir_block, &pos, &r_inode, rname))
+		{
+			if (r_inode == e_inode && !strncmp(rname, name, 252))
+			{
+				if ((b = cowBlock(dir, i)) == -1)
+					return 0;
+				removeRecord(dir_block, prev_pos);
+				writeSFS(b, dir_block);
+				return 1;
 			}
+			prev_pos = pos;
 		}
 	}
+
 	return 0;
 }
+
+/****************************************************************************/
+/* works out where <dst> puts entry <src> of the current directory:
+/*   - a directory in the current directory, or "/"; the entry keeps its name
+/*   - <dir>/<name> or /<name>; there, under the new name
+/*   - any other name; the current directory, under that name
+/* the directory goes in <target> and the name in <name>, which may point
+/* into <dname>, a buffer of 64 characters
+/* returns 0 if there is no such place, or the name is taken there
+/*
+/****************************************************************************/
+
+int resolve_dst(char *src, char *dst, char *dname, int *target, char **name)
+{
+	char *slash;
+
+	*name = src;
+	*target = CD_INODE_ENTRY;
+	strncpy(dname, dst, 64);
+	dname[63] = '\0';
+	if ((slash = strchr(dname, '/')) != NULL)
+	{ // <dir>/<name>, <dir>/, /<name> or /
+		*slash = '\0';
+		if (strlen(slash + 1) > 0)
+			*name = slash + 1;
+		if (strlen(dname) > 0 && (*target = find_entry(dname, 'D')) == -1)
+		{
+			printf("%s: No such directory.\n", dname);
+			return 0;
+		}
+		if (strlen(dname) == 0)
+			*target = 0; // the root
+	}
+	else if ((*target = find_entry(dname, 'D')) == -1)
+	{ // a new name in the same directory
+		*target = CD_INODE_ENTRY;
+		*name = dname;
+	}
+
+	if (strchr(*name, '/') != NULL)
+	{ // only one directory deep
+		printf("%s: No such directory.\n", dst);
+		return 0;
+	}
+	if (find_in(*target, *name, 0) != -1)
+	{
+		printf("%.252s: Already exists.\n", *name);
+		return 0;
+	}
+
+	return 1;
+}
+
+/****************************************************************************/
+/* moves entry <src> of the current directory to where <dst> says (see
+/* resolve_dst), renaming it if asked to
+/* only directory records change; the entry is linked into its new place
+/* before it is unlinked from the old one, all in one write batch
+/*
+/****************************************************************************/
+
+int move(char *src, char *dst)
+{
+	char dname[64], *name;
+	int e_inode = find_entry(src, 0);
+	int target;
+	int ok;
+
+	if (strlen(src) == 0 || strlen(dst) == 0)
+	{
+		printf("Usage: mv <name> <new name or directory>\n");
+		return 0;
+	}
+	if (e_inode == -1)
+	{
+		printf("%.252s: No such file or directory.\n", src);
+		return 0;
+	}
+
+	if (!resolve_dst(src, dst, dname, &target, &name))
+		return 0;
+	if (_inode_table[e_inode].TT[0] == 'D' && in_subtree(e_inode, target))
+	{
+		printf("Error: a directory can not be moved into itself.\n");
+		return 0;
+	}
+
+	beginBatch();
+	if ((ok = link_entry(target, name, e_inode)))
+	{
+		unlink_entry(CD_INODE_ENTRY, src, e_inode);
+		check_dir_block(); // the old block may be empty now
+		if (target != CD_INODE_ENTRY && stoi(_usage_table[e_inode].PPP, 3) == CD_INODE_ENTRY && !dirLinks(CD_INODE_ENTRY, e_inode))
+			moveUsage(e_inode, target); // the usage goes along, unless another name here keeps it
+		else if (linkCount(e_inode) > 1 && otherParent(e_inode) == CD_INODE_ENTRY && !dirLinks(CD_INODE_ENTRY, e_inode))
+			setOtherParent(e_inode, target);
+	}
+	else
+		printf("Error: no room in %s for another entry.\n", (target == CD_INODE_ENTRY ? "this directory" : dst));
+	endBatch();
+
+	return ok;
+}
+/****************************************************************************/
+/* gives file <src> of the current directory another name, where <dst>
+/* says (see resolve_dst); both names point at the same inode entry
+/*
+/****************************************************************************/
+
+int link_file(char *src, char *dst)
+{
+	char dname[64], *name;
+	int e_inode = find_entry(src, 'F');
+	int target, ok;
+
+	if (strlen(src) == 0 || strlen(dst) == 0)
+	{
+		printf("Usage: ln <file> <new name or directory>\n");
+		return 0;
+	}
+	if (e_inode == -1)
+	{
+		printf("%.252s: No such file.\n", src);
+		return 0;
+	}
+	if (!resolve_dst(src, dst, dname, &target, &name))
+		return 0;
+
+	beginBatch();
+	if ((ok = setLinkCount(e_inode, linkCount(e_inode) + 1)))
+	{
+		if (!(ok = link_entry(target, name, e_inode)))
+			setLinkCount(e_inode, linkCount(e_inode) - 1);
+		else // so rm finds a directory to move the usage to without searching the tree
+			setOtherParent(e_inode, (stoi(_usage_table[e_inode].PPP, 3) != target ? target : CD_INODE_ENTRY));
+	}
+	if (!ok)
+		printf("Error: Disk or directory is full.\n");
+	endBatch();
+
+	return ok;
+}
+
+/****************************************************************************/
+/* copies file <src> of the current directory to where <dst> says (see
+/* resolve_dst)
+/* if <reflink> is set, the copy shares the data blocks of the file and
+/* only gets blocks of its own when either of them is written; otherwise
+/* the data is copied
+/*
+/****************************************************************************/
+
+int copy_file(char *src, char *dst, int reflink)
+{
+	char dname[64], *name, buf[SFS_BLOCK_SIZE];
+	int e_inode = find_entry(src, 'F');
+	int target, inode, size, i, k, b, nblocks = 0;
+
+	if (strlen(src) == 0 || strlen(dst) == 0)
+	{
+		printf("Usage: cp [--reflink] <file> <new name or directory>\n");
+		return 0;
+	}
+	if (e_inode == -1)
+	{
+		printf("%.252s: No such file.\n", src);
+		return 0;
+	}
+	if (!resolve_dst(src, dst, dname, &target, &name))
+		return 0;
+	if ((inode = getInode()) == -1)
+	{
+		printf("Error: Inode table is full.\n");
+		return 0;
+	}
+
+	char *from[3] = {_inode_table[e_inode].XX, _inode_table[e_inode].YY, _inode_table[e_inode].ZZ};
+	char *to[3] = {_inode_table[inode].XX, _inode_table[inode].YY, _inode_table[inode].ZZ};
+
+	beginBatch();
+	size = file_size(e_inode);
+	strncpy(_inode_table[inode].TT, "FI", 2);
+	if (!reflink)
+		readAhead(e_inode, 0, 3);
+	for (i = 0; i < 3; i++)
+	{
+		b = stoi(from[i], 2);
+		if (b > 0 && reflink)
+		{
+			if (!setShares(b, _block_shares[b] + 1))
+				break;
+		}
+		else if (b > 0)
+		{
+			readSFS(b, buf);
+			if ((b = getBlock()) == -1)
+				break;
+			writeSFS(b, buf);
+		}
+		itos(to[i], (b > 0 ? b : 0), 2);
+		nblocks += (b > 0 && (!reflink || inode < shareOwner(b, inode)));
+	}
+
+	if (i < 3 || !link_entry(target, name, inode))
+	{ // give back what the copy got so far; slots from i on were not filled in
+		printf("Error: Disk or directory is full.\n");
+		for (k = 0; k < i; k++)
+		{
+			if ((b = stoi(to[k], 2)) > 0 && _block_shares[b] > 1)
+				setShares(b, _block_shares[b] - 1);
+			else if (b > 0)
+				returnBlock(b);
+		}
+		memset(&_inode_table[inode], '0', sizeof(_inode_entry));
+		writeSFS(BLOCK_INODE_TABLE, (char *)_inode_table);
+		returnInode(inode);
+		endBatch();
+		return 0;
+	}
+
+	writeSFS(BLOCK_INODE_TABLE, (char *)_inode_table);
+	set_file_size(inode, size);
+	setParent(inode, target);
+	addUsage(inode, size, nblocks, 1);
+	for (i = 0; i < 3 && reflink; i++)
+		if ((b = stoi(to[i], 2)) > 0 && inode < (k = shareOwner(b, inode)))
+			addUsage(k, 0, -1, 0); // the copy counts the shared block now
+	endBatch();
+
+	return 1;
+}
 int parse_line(char buf[1024], char tokens[8][64])
 {
 	int i, j = 0, ctr = 0;
-	for (i = 0; i <= (strlen(buf)); i++)
+	for (i = 0; i <= (strlen(buf)) && ctr < 8; i++)
 	{
 		if (buf[i] == ' ' || buf[i] == '\0' || buf[i] == '\n')
 		{
@@ -960,7 +4852,7 @@ int parse_line(char buf[1024], char tokens[8][64])
 			ctr++;
 			j = 0;
 		}
-		else
+		else if (j < 63)
 		{
 			tokens[ctr][j] = buf[i];
 			j++;
@@ -968,68 +4860,213 @@ int parse_line(char buf[1024], char tokens[8][64])
 	}
 	return ctr;
 }
-int main()
+/****************************************************************************/
+/* runs the command in <ib>
+/*
+/****************************************************************************/
+
+void run_command(char *ib)
 {
 	int t;
+	char tokens[8][64];
+	memset(tokens, 0, sizeof(tokens));
+	t = parse_line(ib, tokens);
+
+	if ((!strcmp(tokens[0], "creat") || !strcmp(tokens[0], "write") || !strcmp(tokens[0], "append") || !strcmp(tokens[0], "rm") || !strcmp(tokens[0], "md") || !strcmp(tokens[0], "fsck") || !strcmp(tokens[0], "import-tree") || !strcmp(tokens[0], "restripe") || !strcmp(tokens[0], "mkfs") || !strcmp(tokens[0], "mv") || !strcmp(tokens[0], "ln") || !strcmp(tokens[0], "cp") ||
+		 (!strcmp(tokens[0], "defrag") && strcmp(tokens[1], "-n")) ||
+		 (!strcmp(tokens[0], "snap") && (!strcmp(tokens[1], "create") || !strcmp(tokens[1], "rm")))) &&
+		isReadOnly())
+	{
+		return; // nothing may change while a snapshot is mounted
+	}
+
+	if (!strcmp(tokens[0], "display"))
+	{
+		display_file(tokens[1]);
+	}
+	else if (!strcmp(tokens[0], "read"))
+	{
+		int offset = stoi(tokens[2], strlen(tokens[2])), len = stoi(tokens[3], strlen(tokens[3]));
+		if (strlen(tokens[1]) == 0 || strlen(tokens[2]) == 0 || strlen(tokens[3]) == 0 || offset < 0 || len < 0)
+			printf("Usage: read <filename> <offset> <length>\n");
+		else
+			read_file(tokens[1], offset, len);
+	}
+	else if (!strcmp(tokens[0], "write"))
+	{
+		int offset = stoi(tokens[2], strlen(tokens[2]));
+		if (strlen(tokens[1]) == 0 || strlen(tokens[2]) == 0 || offset < 0)
+			printf("Usage: write <filename> <offset>\n");
+		else
+			write_file(tokens[1], offset, 0);
+	}
+	else if (!strcmp(tokens[0], "append"))
+	{
+		write_file(tokens[1], 0, 1);
+	}
+	else if (!strcmp(tokens[0], "creat"))
+	{
+		creat_file(tokens[1], NULL, 0);
+	}
+	else if (!strcmp(tokens[0], "rm"))
+	{
+		if (remove(tokens[1]) == 0)
+		{
+			printf("ERROR: file or dir not found\n.");
+		};
+	}
+	else if (!strcmp(tokens[0], "mv"))
+	{
+		move(tokens[1], tokens[2]);
+	}
+	else if (!strcmp(tokens[0], "ln"))
+	{
+		link_file(tokens[1], tokens[2]);
+	}
+	else if (!strcmp(tokens[0], "cp"))
+	{
+		if (!strcmp(tokens[1], "--reflink"))
+			copy_file(tokens[2], tokens[3], 1);
+		else
+			copy_file(tokens[1], tokens[2], 0);
+	}
+	else if (!strcmp(tokens[0], "ls"))
+	{
+		int sorted = 0, page = 0;
+		for (int k = 1; k < t && k < 8; k++)
+		{
+			if (!strcmp(tokens[k], "-s"))
+				sorted = 1;
+			else if (!strcmp(tokens[k], "-n") && k + 1 < 8)
+				page = stoi(tokens[k + 1], strlen(tokens[k + 1]));
+		}
+		if (page < 0)
+			printf("Usage: ls [-s] [-n <entries per page>]\n");
+		else
+			ls(sorted, page);
+	}
+	else if (!strcmp(tokens[0], "du"))
+	{
+		du(tokens[1]);
+	}
+	else if (!strcmp(tokens[0], "find"))
+	{
+		if (!strcmp(tokens[1], "-name"))
+			find((char *)"", tokens[2]);
+		else if (strlen(tokens[2]) == 0 || !strcmp(tokens[2], "-name"))
+			find(tokens[1], tokens[3]);
+		else
+			printf("Usage: find [Dirname] [-name pattern]\n");
+	}
+	else if (!strcmp(tokens[0], "defrag"))
+	{
+		defrag(!strcmp(tokens[1], "-n"));
+	}
+	else if (!strcmp(tokens[0], "mkfs"))
+	{
+		makeSFS(strlen(tokens[1]) > 0 ? stoi(tokens[1], strlen(tokens[1])) : BLOCK_MAX + 1);
+	}
+	else if (!strcmp(tokens[0], "cd"))
+	{
+		cd(tokens[1]);
+	}
+	else if (!strcmp(tokens[0], "stat"))
+	{
+		stats();
+	}
+	else if (!strcmp(tokens[0], "md"))
+	{
+		md(tokens[1]);
+	}
+	else if (!strcmp(tokens[0], "import-tree"))
+	{
+		import_tree(tokens[1]);
+	}
+	else if (!strcmp(tokens[0], "export-tree"))
+	{
+		export_tree(tokens[1], tokens[2]);
+	}
+	else if (!strcmp(tokens[0], "restripe"))
+	{
+		restripe(stoi(tokens[1], strlen(tokens[1])), stoi(tokens[2], strlen(tokens[2])));
+	}
+	else if (!strcmp(tokens[0], "rd"))
+	{
+		rd();
+	}
+	else if (!strcmp(tokens[0], "fsck"))
+	{
+		fsck(!strcmp(tokens[1], "-r"));
+	}
+	else if (!strcmp(tokens[0], "snap"))
+	{
+		if (!strcmp(tokens[1], "create"))
+			snapCreate(tokens[2]);
+		else if (!strcmp(tokens[1], "ls"))
+			snapList();
+		else if (!strcmp(tokens[1], "mount"))
+			snapMount(tokens[2]);
+		else if (!strcmp(tokens[1], "umount"))
+			snapUmount();
+		else if (!strcmp(tokens[1], "rm"))
+			snapRemove(tokens[2]);
+		else
+			printf("Usage: snap create|ls|mount|umount|rm [name]\n");
+	}
+	else if (!strcmp(tokens[0], "trace"))
+	{
+		if (!strcmp(tokens[1], "start"))
+			traceStart(tokens[2]);
+		else if (!strcmp(tokens[1], "stop"))
+			traceStop();
+		else
+			printf("Usage: trace start <file> | trace stop\n");
+	}
+	else if (!strcmp(tokens[0], "replay"))
+	{
+		replayTrace(tokens[1], !strcmp(tokens[2], "-t"));
+	}
+	else if (!strcmp(tokens[0], "exit"))
+	{
+		if (trace_file != NULL)
+			traceStop();
+		exit(0);
+	}
+	else
+	{
+		printf("No command found\n");
+	}
+}
+int main(int argc, char *argv[])
+{
 	char ib[1024];
-	mountSFS();
+	long start;
+	if (argc > 1 && !strcmp(argv[1], "mkfs"))
+		makeSFS(argc > 2 ? atoi(argv[2]) : BLOCK_MAX + 1); // a new disk, e.g. after compiling for another block size
+	else
+		mountSFS();
 	while (1)
 	{
 		printPrompt();
 		memset(ib, 0, 1024);
-		char tokens[8][64];
-		fgets(ib, 1024, stdin);
+		if (fgets(ib, 1024, stdin) == NULL)
+		{ // end of input
+			if (trace_file != NULL)
+				traceStop();
+			exit(0);
+		}
 		if (ib[0] == '\n')
 		{
 			continue;
 		}
 		else
 		{
-			t = parse_line(ib, tokens);
-
-			if (!strcmp(tokens[0], "display"))
-			{
-				display_file(tokens[1]);
-			}
-			else if (!strcmp(tokens[0], "creat"))
-			{
-				creat_file(tokens[1]);
-			}
-			else if (!strcmp(tokens[0], "rm"))
-			{
-				if (remove(tokens[1]) == 0)
-				{
-					printf("ERROR: file or dir not found\n.");
-				};
-			}
-			else if (!strcmp(tokens[0], "ls"))
-			{
-				ls();
-			}
-			else if (!strcmp(tokens[0], "cd"))
-			{
-				cd(tokens[1]);
-			}
-			else if (!strcmp(tokens[0], "stat"))
-			{
-				stats();
-			}
-			else if (!strcmp(tokens[0], "md"))
-			{
-				md(tokens[1]);
-			}
-			else if (!strcmp(tokens[0], "rd"))
-			{
-				rd();
-			}
-			else if (!strcmp(tokens[0], "exit"))
-			{
-				exit(0);
-			}
-			else
-			{
-				printf("No command found\n");
-			}
+			trace_input_len = 0;
+			trace_typing = 0;
+			start = nowMicros();
+			run_command(ib);
+			if (trace_file != NULL)
+				traceRecord(ib, start, nowMicros() - start - trace_typing);
 		}
 	}
 	return 0;